@@ -1,21 +1,29 @@
 #include "Elf.h"
 
 #include <cxxabi.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <link.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
 
 #include "backtrace.h"
+#include "signal_context.h"
 
 #if UINTPTR_MAX > 0xffffffff
 #define ElfM(type) ELF64_##type
+#define ELFCLASS ELFCLASS64
 #else
 #define ElfM(type) ELF32_##type
+#define ELFCLASS ELFCLASS32
 #endif
 
 namespace backtrace {
@@ -31,6 +39,8 @@ class unique_fd {
   unique_fd(unique_fd&& other) noexcept : fd_(other.fd_) { other.fd_ = -1; }
   unique_fd& operator=(const unique_fd&) = delete;
   unique_fd& operator=(unique_fd&& other) noexcept {
+    if (this == &other) return *this;
+    if (fd_ != -1) close(fd_);
     fd_ = other.fd_;
     other.fd_ = -1;
     return *this;
@@ -43,20 +53,272 @@ class unique_fd {
   int fd_;
 };
 
+// Read-only mapping of part of a file, unmapped on destruction.
+class Mapping {
+ public:
+  Mapping() = default;
+  Mapping(int fd, off_t offset, size_t size) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    off_t aligned = offset & ~static_cast<off_t>(page - 1);
+    length_ = size + (offset - aligned);
+    base_ = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (base_ == MAP_FAILED) return;
+    // symbol tables are scanned once, front to back
+    madvise(base_, length_, MADV_SEQUENTIAL);
+    madvise(base_, length_, MADV_WILLNEED);
+    data_ = static_cast<const uint8_t*>(base_) + (offset - aligned);
+  }
+  ~Mapping() {
+    if (base_ != MAP_FAILED) munmap(base_, length_);
+  }
+
+  Mapping(const Mapping&) = delete;
+  Mapping(Mapping&& other) noexcept
+      : base_(other.base_), length_(other.length_), data_(other.data_) {
+    other.base_ = MAP_FAILED;
+    other.data_ = nullptr;
+  }
+  Mapping& operator=(const Mapping&) = delete;
+  Mapping& operator=(Mapping&&) = delete;
+
+  const uint8_t* data() const { return data_; }
+
+ private:
+  void* base_ = MAP_FAILED;
+  size_t length_ = 0;
+  const uint8_t* data_ = nullptr;
+};
+
+// ELF file whose headers are read with pread; sections are only mapped on
+// request, so the bulk of a large binary (code, debug info) is never touched.
+class ElfFile {
+ public:
+  bool Open(const char* path) {
+    fd_ = unique_fd(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd_ == -1) return false;
+    struct stat sb;
+    if (fstat(fd_, &sb) == -1) return false;
+    size_ = sb.st_size;
+    if (!Read(0, &ehdr_, sizeof(ehdr_))) return false;
+    if (memcmp(ehdr_.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr_.e_ident[EI_CLASS] != ELFCLASS ||
+        ehdr_.e_shentsize != sizeof(ElfW(Shdr)) || ehdr_.e_shoff == 0)
+      return false;
+    // extended numbering keeps the real counts in section header 0
+    ElfW(Shdr) first;
+    if (!Read(ehdr_.e_shoff, &first, sizeof(first))) return false;
+    size_t shnum = ehdr_.e_shnum ? ehdr_.e_shnum : first.sh_size;
+    size_t shstrndx =
+        ehdr_.e_shstrndx == SHN_XINDEX ? first.sh_link : ehdr_.e_shstrndx;
+    shdrs_.resize(shnum);
+    if (shnum == 0 || shstrndx >= shnum ||
+        !Read(ehdr_.e_shoff, shdrs_.data(), shnum * sizeof(ElfW(Shdr))))
+      return false;
+    return ReadSection(shdrs_[shstrndx], &shstrtab_);
+  }
+
+  const ElfW(Shdr) * FindSection(const char* name, ElfW(Word) type) const {
+    for (const auto& shdr : shdrs_) {
+      if (shdr.sh_type == type && shdr.sh_name < shstrtab_.size() &&
+          strcmp(shstrtab_.c_str() + shdr.sh_name, name) == 0)
+        return &shdr;
+    }
+    return nullptr;
+  }
+
+  const ElfW(Shdr) * Section(size_t index) const {
+    return index < shdrs_.size() ? &shdrs_[index] : nullptr;
+  }
+
+  // Map a large section, or return an empty mapping.
+  Mapping Map(const ElfW(Shdr) & shdr) const {
+    if (shdr.sh_type == SHT_NOBITS || !InFile(shdr)) return Mapping();
+    return Mapping(fd_, shdr.sh_offset, shdr.sh_size);
+  }
+
+  // Copy a small section into memory.
+  bool ReadSection(const ElfW(Shdr) & shdr, std::string* out) const {
+    if (shdr.sh_type == SHT_NOBITS || !InFile(shdr)) return false;
+    out->resize(shdr.sh_size);
+    return Read(shdr.sh_offset, &(*out)[0], shdr.sh_size);
+  }
+
+  // CRC-32 of the whole file, as stored in .gnu_debuglink.
+  bool Crc32(uint32_t* crc) const {
+    static const std::vector<uint32_t> table = [] {
+      std::vector<uint32_t> table(256);
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+      }
+      return table;
+    }();
+    std::vector<uint8_t> buffer(65536);
+    uint32_t c = 0xffffffff;
+    for (size_t offset = 0; offset < size_;) {
+      size_t n = std::min(buffer.size(), size_ - offset);
+      if (!Read(offset, &buffer[0], n)) return false;
+      for (size_t i = 0; i < n; i++)
+        c = table[(c ^ buffer[i]) & 0xff] ^ (c >> 8);
+      offset += n;
+    }
+    *crc = c ^ 0xffffffff;
+    return true;
+  }
+
+ private:
+  bool InFile(const ElfW(Shdr) & shdr) const {
+    return shdr.sh_size != 0 && shdr.sh_offset <= size_ &&
+           shdr.sh_size <= size_ - shdr.sh_offset;
+  }
+
+  bool Read(off_t offset, void* buffer, size_t size) const {
+    auto* p = static_cast<uint8_t*>(buffer);
+    while (size > 0) {
+      ssize_t n = pread(fd_, p, size, offset);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      offset += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  unique_fd fd_;
+  size_t size_ = 0;
+  ElfW(Ehdr) ehdr_;
+  std::vector<ElfW(Shdr)> shdrs_;
+  std::string shstrtab_;
+};
+
+namespace {
+constexpr size_t kCacheSize = 256;
+
+struct CacheEntry {
+  const void* pc;
+  const Function* func;
+  ssize_t module;
+  uint64_t generation;
+};
+
+// Plain data, so these need no thread_local initialization guard.
+thread_local CacheEntry cache[kCacheSize];
+thread_local uint64_t cache_hits;
+thread_local uint64_t cache_misses;
+thread_local int signal_depth;
+// set when a lookup skipped loading a debug file, so its answer is not cached
+thread_local bool debug_deferred;
+}  // namespace
+
+std::atomic<uint64_t> Elf::generation_(1);
+std::atomic<Elf*> Elf::instance_(nullptr);
+std::atomic<bool> Elf::building_async_(false);
+
+namespace {
+std::once_flag build_once;
+}  // namespace
+
+void Elf::Build() {
+  std::call_once(build_once, [] {
+    // never destroyed, so lookups stay valid during static destruction
+    instance_.store(new Elf, std::memory_order_release);
+    // publish before invalidating caches that may hold "not ready" misses
+    generation_.fetch_add(1, std::memory_order_release);
+  });
+}
+
 Elf& backtrace::Elf::Instance() {
-  static Elf elf;
-  return elf;
+  Elf* elf = instance_.load(std::memory_order_acquire);
+  if (elf) return *elf;
+  Build();
+  return *instance_.load(std::memory_order_acquire);
 }
 
-Elf::Elf() { Parse(); }
+Elf* Elf::TryInstance() {
+  Elf* elf = instance_.load(std::memory_order_acquire);
+  if (elf || building_async_.load(std::memory_order_relaxed)) return elf;
+  // building allocates, maps files and demangles: never in a signal handler
+  if (backtrace_in_signal()) return nullptr;
+  return &Instance();
+}
+
+int Elf::BuildAsync(bool debug_files) {
+  if (Ready()) {
+    if (debug_files) Instance().LoadDebugFiles();
+    return 0;
+  }
+  // set first: lookups racing with thread creation must not build inline
+  building_async_.store(true, std::memory_order_relaxed);
+  // the builder must not take signals meant for application threads
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int ret = pthread_create(
+      &thread, nullptr,
+      [](void* debug_files) -> void* {
+        Build();
+        if (debug_files) Instance().LoadDebugFiles();
+        return nullptr;
+      },
+      reinterpret_cast<void*>(static_cast<uintptr_t>(debug_files)));
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  if (ret != 0) {
+    building_async_.store(false, std::memory_order_relaxed);
+    return -ret;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+const Function* Elf::Lookup(const void* pc, ssize_t* module) {
+  uint64_t generation = generation_.load(std::memory_order_acquire);
+  auto key = reinterpret_cast<uintptr_t>(pc);
+  CacheEntry& entry = cache[(key * 0x9e3779b97f4a7c15ULL) >> 56];
+  if (entry.pc == pc && entry.generation == generation) {
+    cache_hits++;
+    if (module) *module = entry.module;
+    return entry.func;
+  }
+  cache_misses++;
+  // A signal handler on this thread may probe the entry at any point, so it
+  // stays invalid (generation 0 never matches) until pc and func agree.
+  entry.generation = 0;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  Elf* elf = TryInstance();
+  debug_deferred = false;
+  ssize_t found = -1;
+  const Function* func = elf ? elf->Locate(pc, &found) : nullptr;
+  if (module) *module = found;
+  if (debug_deferred) return func;
+  entry.pc = pc;
+  entry.func = func;
+  entry.module = found;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  entry.generation = generation;
+  return func;
+}
 
-Elf::~Elf() {
-  if (memory_ != MAP_FAILED) munmap(memory_, length_);
+void Elf::CacheStats(uint64_t* hits, uint64_t* misses) {
+  if (hits) *hits = cache_hits;
+  if (misses) *misses = cache_misses;
 }
 
+Elf::Elf() { Parse(); }
+
+Elf::~Elf() { delete code_snapshot_.load(std::memory_order_acquire); }
+
 void Elf::Parse() {
   ParseSelf();
   ParseDl();
+  modules_by_address_.resize(modules_.size());
+  for (size_t i = 0; i < modules_.size(); i++) modules_by_address_[i] = i;
+  std::sort(modules_by_address_.begin(), modules_by_address_.end(),
+            [this](size_t lhs, size_t rhs) {
+              return modules_[lhs].begin < modules_[rhs].begin;
+            });
 }
 
 uint32_t Elf::ParseGnuHash(ElfW(Addr) addr) {
@@ -110,6 +372,7 @@ void Elf::ParseDl() {
   dl_iterate_phdr(
       [](struct dl_phdr_info* info, size_t size, void* that) -> int {
         auto self = static_cast<Elf*>(that);
+        self->AddModule(info);
         for (int i = 0; i < info->dlpi_phnum; i++) {
           if (info->dlpi_phdr[i].p_type != PT_DYNAMIC) continue;
           ElfW(Word) symCnt = 0;
@@ -147,7 +410,8 @@ void Elf::ParseDl() {
             }
           if (gnuSymCnt == 0) gnuSymCnt = symCnt;
           for (ElfW(Word) symIndex = 0; symIndex < gnuSymCnt; symIndex++) {
-            self->AddFunc(&symtab[symIndex], strtab, info->dlpi_addr);
+            AddFunc(&self->funcs_, &symtab[symIndex], strtab,
+                    info->dlpi_addr);
           }
         }
         return 0;
@@ -155,54 +419,97 @@ void Elf::ParseDl() {
       this);
 }
 
-void Elf::ParseSelf() {
-  if (!OpenSelf()) return;
-  ehdr_ = static_cast<ElfW(Ehdr)*>(memory_);
-  ParseSectionHeader();
-}
-
-void Elf::ParseSectionHeader() {
-  // parse .shstrtab firstly
-  shstrtab_ =
-      reinterpret_cast<ElfW(Shdr)*>((uint8_t*)memory_ + ehdr_->e_shoff +
-                                    ehdr_->e_shstrndx * (ehdr_->e_shentsize));
-  for (int i = 0; i < ehdr_->e_shnum; i++) {
-    ElfW(Shdr)* shdr = reinterpret_cast<ElfW(Shdr)*>(
-        (uint8_t*)memory_ + ehdr_->e_shoff + i * (ehdr_->e_shentsize));
-    shdrs_.emplace_back(shdr);
-  }
-  // parse .strtab secondly
-  for (int i = 0; i < ehdr_->e_shnum; i++) {
-    if (shdrs_[i]->sh_type == SHT_STRTAB &&
-        strcmp(SectionName(shdrs_[i]->sh_name), ".strtab") == 0) {
-      strtab_ = shdrs_[i];
-      break;
-    }
-  }
-  for (int i = 0; i < ehdr_->e_shnum; i++) {
-    if (shdrs_[i]->sh_type == SHT_SYMTAB &&
-        strcmp(SectionName(shdrs_[i]->sh_name), ".symtab") == 0) {
-      ParseSymtab(i);
+void Elf::AddModule(const struct dl_phdr_info* info) {
+  Module module;
+  uintptr_t begin = UINTPTR_MAX, end = 0;
+  module.base = info->dlpi_addr;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_LOAD) {
+      begin = std::min<uintptr_t>(begin, info->dlpi_addr + phdr.p_vaddr);
+      end = std::max<uintptr_t>(end,
+                                info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+    } else if (phdr.p_type == PT_NOTE && module.build_id.empty()) {
+      auto* note = reinterpret_cast<const uint8_t*>(info->dlpi_addr +
+                                                    phdr.p_vaddr);
+      auto* notes_end = note + phdr.p_memsz;
+      while (note + sizeof(ElfW(Nhdr)) <= notes_end) {
+        auto* nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+        auto* name = note + sizeof(ElfW(Nhdr));
+        auto* desc = name + ((nhdr->n_namesz + 3) & ~3u);
+        if (desc + nhdr->n_descsz > notes_end) break;
+        if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+            memcmp(name, "GNU", 4) == 0) {
+          module.build_id.assign(reinterpret_cast<const char*>(desc),
+                                 nhdr->n_descsz);
+          break;
+        }
+        note = desc + ((nhdr->n_descsz + 3) & ~3u);
+      }
     }
   }
+  if (begin >= end) return;
+  module.begin = reinterpret_cast<const void*>(begin);
+  module.end = reinterpret_cast<const void*>(end);
+  // the executable is reported with an empty name
+  bool self = !info->dlpi_name || !info->dlpi_name[0];
+  module.path = self ? SelfPath() : info->dlpi_name;
+  modules_.emplace_back(std::move(module));
+  module_debug_.emplace_back(new ModuleDebug);
+  module_debug_.back()->wanted = !(self && self_has_symtab_);
+}
+
+ssize_t Elf::LocateModule(const void* pc) const {
+  auto it = std::upper_bound(modules_by_address_.begin(),
+                             modules_by_address_.end(), pc,
+                             [this](const void* pc, size_t index) {
+                               return pc < modules_[index].begin;
+                             });
+  if (it == modules_by_address_.begin()) return -1;
+  --it;
+  return pc < modules_[*it].end ? static_cast<ssize_t>(*it) : -1;
 }
 
-void Elf::ParseSymtab(size_t index) {
-  ElfW(Shdr)* shdr = shdrs_[index];
-  auto* sym = reinterpret_cast<ElfW(Sym)*>((uint8_t*)memory_ + shdr->sh_offset);
-  auto* end = reinterpret_cast<ElfW(Sym)*>((uint8_t*)memory_ + shdr->sh_offset +
-                                           shdr->sh_size);
+void Elf::ParseSelf() {
+  ElfFile file;
+  if (!OpenSelf(&file)) return;
+  // .symtab holds link-time addresses; a PIE needs its load bias added, and
+  // glibc always reports the executable first
+  ElfW(Addr) bias = 0;
+  dl_iterate_phdr(
+      [](struct dl_phdr_info* info, size_t size, void* bias) -> int {
+        *static_cast<ElfW(Addr)*>(bias) = info->dlpi_addr;
+        return 1;
+      },
+      &bias);
+  ParseSymtab(file, bias, &funcs_);
+  self_has_symtab_ = !funcs_.empty();
+}
+
+void Elf::ParseSymtab(const ElfFile& file, ElfW(Addr) offset,
+                      FunctionMap* funcs) {
+  const ElfW(Shdr)* symtab = file.FindSection(".symtab", SHT_SYMTAB);
+  if (!symtab) return;
+  const ElfW(Shdr)* strtab = file.Section(symtab->sh_link);
+  if (!strtab || strtab->sh_type != SHT_STRTAB) return;
+  // names are copied into funcs, so both mappings can go once we are done
+  Mapping syms = file.Map(*symtab);
+  Mapping strs = file.Map(*strtab);
+  if (!syms.data() || !strs.data()) return;
+  auto* sym = reinterpret_cast<const ElfW(Sym)*>(syms.data());
+  auto* end = sym + symtab->sh_size / sizeof(ElfW(Sym));
   for (; sym < end; sym++) {
-    AddFunc(sym);
+    if (sym->st_name >= strtab->sh_size) continue;
+    AddFunc(funcs, sym, reinterpret_cast<const char*>(strs.data()), offset);
   }
 }
 
-bool Elf::OpenSelf() {
+std::string Elf::SelfPath() {
   std::string path("/proc/self/exe");
   struct stat sb;
   do {
     if (lstat(path.c_str(), &sb) == -1) {
-      return false;
+      return std::string();
     }
     if (!S_ISLNK(sb.st_mode)) {
       break;
@@ -211,46 +518,195 @@ bool Elf::OpenSelf() {
     buffer.resize(sb.st_size == 0 ? 1024 : sb.st_size);
     int ret =
         readlink(path.c_str(), const_cast<char*>(buffer.data()), buffer.size());
-    if (ret == -1) return false;
+    if (ret == -1) return std::string();
     path = buffer.substr(0, ret);
   } while (true);
-  auto fd = unique_fd(open(path.c_str(), O_RDONLY));
-  if (fd == -1) return false;
-  if (fstat(fd, &sb) == -1) return false;
-  length_ = sb.st_size;
-  memory_ = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (memory_ == MAP_FAILED) {
-    return false;
-  }
-  return true;
+  return path;
 }
-const char* Elf::SectionName(size_t offset) {
-  return (const char*)memory_ + shstrtab_->sh_offset + offset;
+
+bool Elf::OpenSelf(ElfFile* file) {
+  std::string path = SelfPath();
+  return !path.empty() && file->Open(path.c_str());
 }
-const char* Elf::SymbolName(size_t offset) {
-  return (const char*)memory_ + strtab_->sh_offset + offset;
+Function* Elf::Locate(const void* pc, ssize_t* module) {
+  ssize_t index = LocateModule(pc);
+  if (module) *module = index;
+  if (Function* func = LocateDebug(pc, index)) return func;
+  if (Function* func = Find(&funcs_, pc)) return func;
+  return LocateCode(pc);
 }
-Function* Elf::Locate(const void* pc) {
-  if (funcs_.empty()) return nullptr;
-  auto func = funcs_.lower_bound(pc);
-  if (func == funcs_.end()) {
-    if (funcs_.rbegin()->second.end() >= pc) return &funcs_.rbegin()->second;
+Function* Elf::Find(FunctionMap* funcs, const void* pc) {
+  if (funcs->empty()) return nullptr;
+  auto func = funcs->lower_bound(pc);
+  if (func == funcs->end()) {
+    if (funcs->rbegin()->second.end() >= pc) return &funcs->rbegin()->second;
     return nullptr;
   } else if (func->second.begin > pc) {
-    if (func == funcs_.begin()) return nullptr;
+    if (func == funcs->begin()) return nullptr;
     func--;
   }
   if (func->second.end() >= pc) return &func->second;
   return nullptr;
 }
-void Elf::AddFunc(ElfW(Sym) * sym, const char* strtab, ElfW(Addr) offset) {
+Function* Elf::LocateDebug(const void* pc, ssize_t index) {
+  if (index < 0) return nullptr;
+  ModuleDebug& debug = *module_debug_[index];
+  if (!debug.wanted) return nullptr;
+  if (!debug.loaded.load(std::memory_order_acquire)) {
+    // opening and checksumming files is not async-signal-safe, so handlers
+    // fall back to the dynamic symbols until the file is loaded elsewhere
+    if (backtrace_in_signal()) {
+      debug_deferred = true;
+      return nullptr;
+    }
+    LoadDebug(index);
+  }
+  return Find(&debug.funcs, pc);
+}
+void Elf::LoadDebug(size_t index) {
+  ModuleDebug& debug = *module_debug_[index];
+  std::call_once(debug.once, [&] {
+    LoadDebugSymbols(modules_[index], &debug.funcs);
+    debug.loaded.store(true, std::memory_order_release);
+    // drop fallback names cached while the file was not loaded
+    if (!debug.funcs.empty())
+      generation_.fetch_add(1, std::memory_order_release);
+  });
+}
+void Elf::LoadDebugFiles() {
+  for (size_t i = 0; i < module_debug_.size(); i++)
+    if (module_debug_[i]->wanted) LoadDebug(i);
+}
+void Elf::LoadDebugSymbols(const Module& module, FunctionMap* funcs) {
+  ElfFile file;
+  if (!OpenDebugFile(module, &file)) return;
+  ParseSymtab(file, module.base, funcs);
+}
+bool Elf::OpenDebugFile(const Module& module, ElfFile* file) {
+  static const char kDebugDir[] = "/usr/lib/debug";
+  if (module.build_id.size() >= 2) {
+    static const char kHex[] = "0123456789abcdef";
+    std::string path = std::string(kDebugDir) + "/.build-id/";
+    for (size_t i = 0; i < module.build_id.size(); i++) {
+      uint8_t byte = module.build_id[i];
+      path += kHex[byte >> 4];
+      path += kHex[byte & 0xf];
+      if (i == 0) path += '/';
+    }
+    path += ".debug";
+    if (file->Open(path.c_str())) return true;
+  }
+
+  // .gnu_debuglink: file name, padding to 4 bytes, then CRC-32 of the file
+  std::string link;
+  {
+    ElfFile self;
+    const ElfW(Shdr)* shdr;
+    if (!self.Open(module.path.c_str()) ||
+        !(shdr = self.FindSection(".gnu_debuglink", SHT_PROGBITS)) ||
+        !self.ReadSection(*shdr, &link))
+      return false;
+  }
+  size_t name_size = strnlen(link.data(), link.size());
+  size_t crc_offset = (name_size + 4) & ~size_t(3);
+  if (name_size == 0 || crc_offset + 4 > link.size()) return false;
+  uint32_t expected;
+  memcpy(&expected, link.data() + crc_offset, sizeof(expected));
+  std::string name = link.substr(0, name_size);
+  std::string dir = module.path.substr(0, module.path.rfind('/') + 1);
+  for (const std::string& path :
+       {dir + name, dir + ".debug/" + name, kDebugDir + dir + name}) {
+    ElfFile candidate;
+    uint32_t crc;
+    if (path == module.path || !candidate.Open(path.c_str()) ||
+        !candidate.Crc32(&crc) || crc != expected)
+      continue;
+    *file = std::move(candidate);
+    return true;
+  }
+  return false;
+}
+Function* Elf::LocateCode(const void* pc) {
+  if (!code_snapshot_.load(std::memory_order_acquire)) return nullptr;
+  // lock-free, so it is safe even in a handler that interrupted a writer
+  code_readers_.fetch_add(1, std::memory_order_seq_cst);
+  const CodeSnapshot* snapshot = code_snapshot_.load(std::memory_order_seq_cst);
+  auto it = std::upper_bound(
+      snapshot->funcs.begin(), snapshot->funcs.end(), pc,
+      [](const void* pc, const Function* func) { return pc < func->begin; });
+  Function* func = nullptr;
+  if (it != snapshot->funcs.begin() && pc < (*--it)->end()) func = *it;
+  code_readers_.fetch_sub(1, std::memory_order_release);
+  return func;
+}
+void Elf::AddCodeLocked(const void* begin, size_t size, std::string name) {
+  std::unique_ptr<Function> func(new Function{std::move(name), begin, size});
+  auto& slot = code_[begin];
+  if (slot) retired_code_.emplace_back(std::move(slot));
+  slot = std::move(func);
+}
+void Elf::PublishCodeLocked() {
+  std::unique_ptr<CodeSnapshot> snapshot(new CodeSnapshot);
+  snapshot->funcs.reserve(code_.size());
+  for (auto& code : code_) snapshot->funcs.push_back(code.second.get());
+  CodeSnapshot* old =
+      code_snapshot_.exchange(snapshot.release(), std::memory_order_seq_cst);
+  if (old) retired_snapshots_.emplace_back(old);
+  // a reader that arrives from now on can only load the new snapshot
+  if (code_readers_.load(std::memory_order_seq_cst) == 0)
+    retired_snapshots_.clear();
+  generation_.fetch_add(1, std::memory_order_release);
+}
+void Elf::AddCode(const void* begin, size_t size, std::string name) {
+  std::lock_guard<std::mutex> lock(code_mutex_);
+  AddCodeLocked(begin, size, std::move(name));
+  PublishCodeLocked();
+}
+int Elf::LoadPerfMap(const std::string& path) {
+  std::lock_guard<std::mutex> lock(code_mutex_);
+  if (path != perf_map_path_) {
+    perf_map_path_ = path;
+    perf_map_offset_ = 0;
+  }
+  auto fd = unique_fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) return -errno;
+  size_t added = 0;
+  std::string buffer;
+  char chunk[65536];
+  for (;;) {
+    ssize_t n = pread(fd, chunk, sizeof(chunk),
+                      perf_map_offset_ + static_cast<off_t>(buffer.size()));
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    buffer.append(chunk, n);
+  }
+  // only complete lines are consumed; a partial one is reread next time
+  size_t begin = 0;
+  for (size_t end; (end = buffer.find('\n', begin)) != std::string::npos;
+       begin = end + 1) {
+    std::string line = buffer.substr(begin, end - begin);
+    char* next;
+    unsigned long long start = strtoull(line.c_str(), &next, 16);
+    if (next == line.c_str() || *next != ' ') continue;
+    unsigned long long size = strtoull(next + 1, &next, 16);
+    if (*next != ' ') continue;
+    AddCodeLocked(reinterpret_cast<const void*>(start), size,
+                  std::string(next + 1));
+    added++;
+  }
+  perf_map_offset_ += begin;
+  if (added) PublishCodeLocked();
+  return static_cast<int>(added);
+}
+void Elf::AddFunc(FunctionMap* funcs, const ElfW(Sym) * sym,
+                  const char* strtab, ElfW(Addr) offset) {
   if (ElfM(ST_TYPE)(sym->st_info) != STT_FUNC) return;
-  const char* name = strtab ? strtab + sym->st_name : SymbolName(sym->st_name);
+  const char* name = strtab + sym->st_name;
   char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, nullptr);
   if (demangled != nullptr) {
     name = demangled;
   }
-  auto result = funcs_.emplace(
+  auto result = funcs->emplace(
       reinterpret_cast<const void*>(sym->st_value + offset),
       Function{.name = name,
                .begin = reinterpret_cast<const void*>(sym->st_value + offset),
@@ -260,11 +716,86 @@ void Elf::AddFunc(ElfW(Sym) * sym, const char* strtab, ElfW(Addr) offset) {
 }  // namespace backtrace
 
 const char* addr_to_name(const void* p) {
-  auto func = backtrace::Elf::Instance().Locate(p);
+  auto func = backtrace::Elf::Lookup(p);
   return func ? func->name.c_str() : nullptr;
 }
 
 size_t addr_to_offset(const void* p) {
-  auto func = backtrace::Elf::Instance().Locate(p);
+  auto func = backtrace::Elf::Lookup(p);
   return func ? (uint8_t*)p - (uint8_t*)func->begin : 0;
+}
+
+void backtrace_cache_stats(uint64_t* hits, uint64_t* misses) {
+  backtrace::Elf::CacheStats(hits, misses);
+}
+
+size_t backtrace_module_count() {
+  auto elf = backtrace::Elf::TryInstance();
+  return elf ? elf->modules().size() : 0;
+}
+
+int backtrace_module_get(size_t index, struct backtrace_module* module) {
+  auto elf = backtrace::Elf::TryInstance();
+  if (!elf || index >= elf->modules().size()) return -1;
+  auto& modules = elf->modules();
+  module->path = modules[index].path.c_str();
+  module->base = modules[index].base;
+  module->build_id =
+      reinterpret_cast<const unsigned char*>(modules[index].build_id.data());
+  module->build_id_size = modules[index].build_id.size();
+  return 0;
+}
+
+int backtrace_module_of(const void* pc, size_t* index, uintptr_t* offset) {
+  ssize_t found;
+  backtrace::Elf::Lookup(pc, &found);
+  if (found < 0) return -1;
+  // a module was found, so the index is built
+  auto elf = backtrace::Elf::TryInstance();
+  *index = found;
+  *offset = reinterpret_cast<uintptr_t>(pc) - elf->modules()[found].base;
+  return 0;
+}
+
+int backtrace_init(int mode) {
+  bool debug_files = mode & BACKTRACE_INIT_DEBUG_FILES;
+  switch (mode & ~BACKTRACE_INIT_DEBUG_FILES) {
+    case BACKTRACE_INIT_LAZY:
+      return debug_files ? -EINVAL : 0;
+    case BACKTRACE_INIT_SYNC:
+      if (debug_files) {
+        backtrace::Elf::Instance().LoadDebugFiles();
+      } else {
+        backtrace::Elf::Instance();
+      }
+      return 0;
+    case BACKTRACE_INIT_ASYNC:
+      return backtrace::Elf::BuildAsync(debug_files);
+    default:
+      return -EINVAL;
+  }
+}
+
+void backtrace_signal_enter() { backtrace::signal_depth++; }
+
+void backtrace_signal_leave() { backtrace::signal_depth--; }
+
+int backtrace_in_signal() {
+  if (backtrace::signal_depth > 0) return 1;
+  // crash handlers usually run on an alternate stack
+  stack_t ss;
+  return sigaltstack(nullptr, &ss) == 0 && (ss.ss_flags & SS_ONSTACK);
+}
+
+int backtrace_ready() { return backtrace::Elf::Ready(); }
+
+int backtrace_load_perf_map(const char* path) {
+  std::string file = path ? path
+                          : "/tmp/perf-" + std::to_string(getpid()) + ".map";
+  return backtrace::Elf::Instance().LoadPerfMap(file);
+}
+
+void backtrace_register_code(const void* begin, size_t size,
+                             const char* name) {
+  backtrace::Elf::Instance().AddCode(begin, size, name ? name : "");
 }
\ No newline at end of file
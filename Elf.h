@@ -3,27 +3,65 @@
 
 #ifdef __cplusplus
 #include <link.h>
-#include <sys/mman.h>
 
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 namespace backtrace {
+class ElfFile;
 struct Function final {
   std::string name;
   const void* begin;
   size_t size;
   const void* end() const { return (uint8_t*)begin + size; }
 };
+struct Module final {
+  std::string path;
+  uintptr_t base;  // load bias, pc - base is the link-time address
+  const void* begin;
+  const void* end;
+  std::string build_id;  // raw NT_GNU_BUILD_ID bytes, empty if none
+};
 class Elf final {
  public:
+  using FunctionMap = std::map<const void*, Function>;
+
   Elf(const Elf&) = delete;
   Elf(Elf&&) = delete;
   Elf& operator=(const Elf&) = delete;
   Elf& operator=(Elf&&) = delete;
 
-  Function* Locate(const void* pc);
+  // Also stores the index of the module mapping pc, or -1, if asked.
+  Function* Locate(const void* pc, ssize_t* module = nullptr);
+  // Index into modules() of the module mapping pc, or -1.
+  ssize_t LocateModule(const void* pc) const;
+  // Loaded modules in dl_iterate_phdr order, executable first.
+  const std::vector<Module>& modules() const { return modules_; }
 
+  // Load entries appended to a perf map ("start size name" lines in hex)
+  // since the previous call for the same path.
+  int LoadPerfMap(const std::string& path);
+  // Add a JIT code range; a later range at the same address replaces it.
+  void AddCode(const void* begin, size_t size, std::string name);
+
+  // Builds the index on first use, waiting for a background build if any.
   static Elf& Instance();
+  // Like Instance(), but null while a background build is still running,
+  // or in a signal handler before anything has built the index.
+  static Elf* TryInstance();
+  // Start building the index on a background thread, then load every
+  // module's separate debug file there too if asked.
+  static int BuildAsync(bool debug_files);
+  static bool Ready() { return instance_.load(std::memory_order_acquire); }
+  // Locate() behind a small per-thread cache keyed by pc; the module index
+  // is cached alongside the function.
+  static const Function* Lookup(const void* pc, ssize_t* module = nullptr);
+  // Load every module's separate debug file now rather than on first use.
+  void LoadDebugFiles();
+  static void CacheStats(uint64_t* hits, uint64_t* misses);
 
  private:
   Elf();
@@ -32,24 +70,66 @@ class Elf final {
   void Parse();
   void ParseSelf();
   void ParseDl();
-  bool OpenSelf();
-  void ParseSectionHeader();
-  void ParseSymtab(size_t index);
-  const char* SectionName(size_t offset);
-  const char* SymbolName(size_t offset);
+  bool OpenSelf(ElfFile* file);
+  void AddModule(const struct dl_phdr_info* info);
+  static std::string SelfPath();
+  static void ParseSymtab(const ElfFile& file, ElfW(Addr) offset,
+                          FunctionMap* funcs);
 
-  void AddFunc(ElfW(Sym) * sym, const char* strtab = nullptr,
-               ElfW(Addr) offset = 0);
+  static void AddFunc(FunctionMap* funcs, const ElfW(Sym) * sym,
+                      const char* strtab, ElfW(Addr) offset = 0);
+  static Function* Find(FunctionMap* funcs, const void* pc);
 
   static uint32_t ParseGnuHash(ElfW(Addr) addr);
 
-  void* memory_ = MAP_FAILED;
-  size_t length_ = 0;
-  ElfW(Ehdr) * ehdr_ = nullptr;
-  std::vector<ElfW(Shdr)*> shdrs_;
-  ElfW(Shdr*) shstrtab_ = nullptr;
-  ElfW(Shdr*) strtab_ = nullptr;
-  std::map<const void*, Function> funcs_;
+  // Symbols from the module's separate debug file, loaded on first use.
+  Function* LocateDebug(const void* pc, ssize_t index);
+  void LoadDebug(size_t index);
+  static void LoadDebugSymbols(const Module& module, FunctionMap* funcs);
+  static bool OpenDebugFile(const Module& module, ElfFile* file);
+
+  Function* LocateCode(const void* pc);
+  void AddCodeLocked(const void* begin, size_t size, std::string name);
+  void PublishCodeLocked();
+
+  static void Build();
+
+  // Bumped whenever funcs_ or code_ changes, invalidating every thread's
+  // cache.
+  static std::atomic<uint64_t> generation_;
+  static std::atomic<Elf*> instance_;
+  static std::atomic<bool> building_async_;
+
+  FunctionMap funcs_;
+  std::vector<Module> modules_;
+  std::vector<size_t> modules_by_address_;
+
+  struct ModuleDebug {
+    bool wanted;  // false if the module's own symbols are complete
+    std::once_flag once;
+    std::atomic<bool> loaded{false};
+    FunctionMap funcs;  // never changed once loaded
+  };
+  // Parallel to modules_.
+  std::vector<std::unique_ptr<ModuleDebug>> module_debug_;
+  bool self_has_symtab_ = false;
+
+  // JIT code from perf maps and registration, kept apart from the ELF
+  // symbols so that adding to it never touches funcs_. Writers hold
+  // code_mutex_; readers only see immutable snapshots and never lock.
+  struct CodeSnapshot {
+    std::vector<Function*> funcs;  // sorted by begin
+  };
+  std::mutex code_mutex_;
+  std::map<const void*, std::unique_ptr<Function>> code_;
+  // replaced entries stay alive, callers may still hold their names
+  std::vector<std::unique_ptr<Function>> retired_code_;
+  std::atomic<CodeSnapshot*> code_snapshot_{nullptr};
+  // LocateCode() calls in flight; older snapshots are freed when it is 0
+  std::atomic<int> code_readers_{0};
+  std::vector<std::unique_ptr<CodeSnapshot>> retired_snapshots_;
+  std::string perf_map_path_;
+  off_t perf_map_offset_ = 0;
 };
 }  // namespace backtrace
 #endif
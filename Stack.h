@@ -0,0 +1,107 @@
+#ifndef BACKTRACE_STACK_H
+#define BACKTRACE_STACK_H
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+
+#include "Elf.h"
+#include "backtrace.h"
+#include "stack_hash.h"
+
+namespace backtrace {
+struct Frame final {
+  const void* pc;
+  const Function* function;  // nullptr if the pc could not be symbolized
+
+  const char* name() const {
+    return function ? function->name.c_str() : nullptr;
+  }
+  size_t offset() const {
+    return function ? (const uint8_t*)pc - (const uint8_t*)function->begin : 0;
+  }
+};
+
+// Fixed-capacity captured stack: raw pcs live inline, the hash is computed
+// once at capture time, and frames are only symbolized when iterated.
+template <size_t N>
+class Stack final {
+  static_assert(N > 0, "Stack capacity must be positive");
+
+ public:
+  class Iterator final {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Frame;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = Frame;
+
+    explicit Iterator(void* const* pc) : pc_(pc) {}
+    Frame operator*() const { return Frame{*pc_, Elf::Lookup(*pc_)}; }
+    Iterator& operator++() {
+      ++pc_;
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator old = *this;
+      ++pc_;
+      return old;
+    }
+    bool operator==(const Iterator& other) const { return pc_ == other.pc_; }
+    bool operator!=(const Iterator& other) const { return pc_ != other.pc_; }
+
+   private:
+    void* const* pc_;
+  };
+
+  // Replace the contents with the caller's stack, dropping Skip innermost
+  // frames. Always inlined so that Skip counts from the caller.
+  template <size_t Skip = 0>
+  __attribute__((always_inline)) inline void Capture() {
+    depth_ = backtrace_capture(nullptr, pcs_, N, Skip);
+    hash_ = Hash(pcs_, depth_);
+  }
+
+  static constexpr size_t capacity() { return N; }
+  size_t depth() const { return depth_; }
+  bool empty() const { return depth_ == 0; }
+  size_t hash() const { return hash_; }
+  const void* pc(size_t index) const { return pcs_[index]; }
+  void* const* pcs() const { return pcs_; }
+
+  Iterator begin() const { return Iterator(pcs_); }
+  Iterator end() const { return Iterator(pcs_ + depth_); }
+
+  bool operator==(const Stack& other) const {
+    if (hash_ != other.hash_ || depth_ != other.depth_) return false;
+    for (size_t i = 0; i < depth_; i++)
+      if (pcs_[i] != other.pcs_[i]) return false;
+    return true;
+  }
+  bool operator!=(const Stack& other) const { return !(*this == other); }
+
+ private:
+  static size_t Hash(void* const* pcs, size_t depth) {
+    return static_cast<size_t>(stack_hash(pcs, depth));
+  }
+
+  void* pcs_[N];
+  size_t depth_ = 0;
+  size_t hash_ = 0;
+};
+}  // namespace backtrace
+
+namespace std {
+template <size_t N>
+struct hash<backtrace::Stack<N>> {
+  size_t operator()(const backtrace::Stack<N>& stack) const {
+    return stack.hash();
+  }
+};
+}  // namespace std
+#endif
+
+#endif  // BACKTRACE_STACK_H
@@ -1,21 +1,20 @@
 #include "backtrace.h"
+#include "signal_context.h"
 
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>  //for getpid
 #if defined(__MIPSEB__) || defined(__MIPSEL__)
 #include <asm/ptrace.h>  //for struct pt_regs
-#include <unistd.h>      //for getpid
+#include <pthread.h>
+#include <sys/uio.h>
 #else
 #include <unwind.h>
 #endif
 
-static void unwind_print(const void *pc, const char *name, size_t offset,
-                         void *userdata) {
-  printf("\t=>%s()+0x%zu\n", name, offset);
-}
-
 #if defined(__MIPSEB__) || defined(__MIPSEL__)
 
 static inline int is_jal_jalr_jr_ins(union mips_instruction *ip) {
@@ -64,16 +63,14 @@ struct dwarf_fde {
 extern const struct dwarf_fde *_Unwind_Find_FDE(void *,
                                                 struct dwarf_eh_bases *);
 
-static pid_t hold_ra() {
-  /* do nothing. */
-  return getpid();
+/* a real call that does nothing, so it costs no syscall or stdio */
+static __attribute__((noinline, noclone)) void hold_ra() {
+  __asm__ __volatile__("" ::: "memory");
 }
 
 /* get general registers value.*/
 static __always_inline void prepare_frametrace(struct pt_regs *regs) {
-  pid_t _i = 0;
-  _i = hold_ra();  // ensure ra is pointed to the function itself.
-  printf("%d\n", _i);
+  hold_ra();  // ensure ra is pointed to the function itself.
 
   __asm__ __volatile__(
       ".set noreorder\n\t"
@@ -94,126 +91,363 @@ static __always_inline void prepare_frametrace(struct pt_regs *regs) {
       : "memory");
 }
 
-/* recursively look for sp and ra. sp for stack address space, ra for text
+#define MAX_FRAMES 256
+
+struct StackBounds {
+  unsigned long low;
+  unsigned long high; /* one past the end */
+};
+
+/*
+ * Stacks the unwinder may read without validation. Computed on the first
+ * unwind in each thread; pthread_getattr_np is not async-signal-safe for the
+ * main thread, so take one trace before relying on it from a crash handler.
+ */
+static __thread int stack_bounds_ready;
+static __thread struct StackBounds thread_stack;
+static __thread struct StackBounds alt_stack;
+
+static void init_stack_bounds() {
+  pthread_attr_t attr;
+  stack_t ss;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void *addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+      thread_stack.low = (unsigned long)addr;
+      thread_stack.high = (unsigned long)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  if (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE)) {
+    alt_stack.low = (unsigned long)ss.ss_sp;
+    alt_stack.high = (unsigned long)ss.ss_sp + ss.ss_size;
+  }
+  stack_bounds_ready = 1;
+}
+
+static inline int in_stack(const struct StackBounds *stack,
+                           unsigned long addr) {
+  return addr >= stack->low && addr < stack->high &&
+         stack->high - addr >= sizeof(unsigned long);
+}
+
+/* read a saved register, failing instead of faulting on a bad address */
+static int read_stack(unsigned long addr, unsigned long *value) {
+  struct iovec local, remote;
+  if (addr & (sizeof(unsigned long) - 1)) return 0;
+  if (in_stack(&thread_stack, addr) || in_stack(&alt_stack, addr)) {
+    *value = *(unsigned long *)addr;
+    return 1;
+  }
+  /* not on a known stack: let the kernel validate the address */
+  local.iov_base = value;
+  local.iov_len = sizeof(*value);
+  remote.iov_base = (void *)addr;
+  remote.iov_len = sizeof(*value);
+  return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+         sizeof(*value);
+}
+
+struct IncrementalData;
+/* non-zero if the walk can stop at the frame at sp returning to ra */
+static int incremental_stop(struct IncrementalData *incremental,
+                            unsigned long sp, unsigned long ra);
+/* ra_slot is where the caller's pc of the frame just reported was read */
+static void incremental_slot(struct IncrementalData *incremental,
+                             unsigned long ra_slot);
+
+/* look for sp and ra frame by frame. sp for stack address space, ra for text
  * section. */
 static void do_backtrace(unsigned long sp, unsigned long ra, unsigned long fp,
                          void (*callback)(const void *pc, const char *name,
                                           size_t offset, void *userdata),
-                         void *userdata) {
-  int index = 0;
-  union mips_instruction *ip;
-  unsigned int max_insns;
-  unsigned int i;
-  const char *caller_name = NULL;
-  size_t offset;
-  bool found_ra = 0;
-  int ra_offset = 0;
-  bool found_fp = 0;
-  int fp_offset = 0;
-  int frame_size = 0;
-  int has_move_s8_sp = 0;
-
-  caller_name = addr_to_name((const void *)ra);
-  if (caller_name == NULL) {
-    return;
-  }
-  offset = addr_to_offset((const void *)ra);
-  ip = (union mips_instruction *)(ra - offset);
-  /* maybe end of last function */
-  if (offset < 8) {
-    unsigned long raw_ra = ra - 8;
-    const char *name = addr_to_name((const void *)raw_ra);
-    if (name != NULL) {
-      caller_name = name;
-      offset = addr_to_offset((const void *)raw_ra);
-      ip = (union mips_instruction *)(raw_ra - offset);
-    }
-  }
+                         void *userdata,
+                         struct IncrementalData *incremental) {
+  unsigned int depth;
 
-  if (callback)
-    callback((const void *)ra, caller_name, ra - (unsigned long)ip, userdata);
+  if (!stack_bounds_ready) init_stack_bounds();
+  for (depth = 0; depth < MAX_FRAMES; depth++) {
+    union mips_instruction *ip;
+    unsigned int max_insns;
+    unsigned int i;
+    const char *caller_name = NULL;
+    size_t offset;
+    bool found_ra = 0;
+    int ra_offset = 0;
+    bool found_fp = 0;
+    int fp_offset = 0;
+    int frame_size = 0;
+    int has_move_s8_sp = 0;
+    unsigned long base, next_sp, next_ra, next_fp = fp;
 
-  /* only search in instructions already executed. */
-  max_insns = (ra - (unsigned long)ip) / sizeof(union mips_instruction);
-  if (max_insns == 0) {
-    max_insns = 128U; /* unknown function size */
-  }
-  max_insns = max_insns < 128U ? max_insns : 128U;
-
-  /* find sp and ra (userspace functions use fp, so sp is not changed) */
-  for (i = 0; i < max_insns; i++, ip++) {
-    if (is_jal_jalr_jr_ins(ip)) break;
-    if (is_move_s8_sp_ins(ip)) {
-      has_move_s8_sp = 1;
-      continue;
+    /* before any symbolization or prologue scan */
+    if (incremental && incremental_stop(incremental, sp, ra)) return;
+    caller_name = addr_to_name((const void *)ra);
+    if (caller_name == NULL) {
+      return;
     }
-    if (!frame_size) {
-      if (is_sp_move_ins(ip)) {
-        frame_size = -ip->i_format.simmediate;  // size of function stack
+    offset = addr_to_offset((const void *)ra);
+    ip = (union mips_instruction *)(ra - offset);
+    /* maybe end of last function */
+    if (offset < 8) {
+      unsigned long raw_ra = ra - 8;
+      const char *name = addr_to_name((const void *)raw_ra);
+      if (name != NULL) {
+        caller_name = name;
+        offset = addr_to_offset((const void *)raw_ra);
+        ip = (union mips_instruction *)(raw_ra - offset);
       }
-      continue;
     }
-    if (!ra_offset) {  // find ra
-      if (is_ra_save_ins(ip)) {
-        found_ra = true;
-        ra_offset = ip->i_format.simmediate;
+
+    if (callback)
+      callback((const void *)ra, caller_name, ra - (unsigned long)ip,
+               userdata);
+
+    /* only search in instructions already executed. */
+    max_insns = (ra - (unsigned long)ip) / sizeof(union mips_instruction);
+    if (max_insns == 0) {
+      max_insns = 128U; /* unknown function size */
+    }
+    max_insns = max_insns < 128U ? max_insns : 128U;
+
+    /* find sp and ra (userspace functions use fp, so sp is not changed) */
+    for (i = 0; i < max_insns; i++, ip++) {
+      if (is_jal_jalr_jr_ins(ip)) break;
+      if (is_move_s8_sp_ins(ip)) {
+        has_move_s8_sp = 1;
         continue;
       }
-    }
-    if (!fp_offset) {
-      if (is_s8_save_ins(ip)) {
-        found_fp = true;
-        fp_offset = ip->i_format.simmediate;
+      if (!frame_size) {
+        if (is_sp_move_ins(ip)) {
+          frame_size = -ip->i_format.simmediate;  // size of function stack
+        }
         continue;
       }
+      if (!ra_offset) {  // find ra
+        if (is_ra_save_ins(ip)) {
+          found_ra = true;
+          ra_offset = ip->i_format.simmediate;
+          continue;
+        }
+      }
+      if (!fp_offset) {
+        if (is_s8_save_ins(ip)) {
+          found_fp = true;
+          fp_offset = ip->i_format.simmediate;
+          continue;
+        }
+      }
     }
-  }
 
-  if (found_ra) {
+    if (!found_ra) return;
     /* maybe frame size is dynamic */
-    if (has_move_s8_sp && sp != fp) {
-      do_backtrace(fp + frame_size, *(unsigned long *)(fp + ra_offset),
-                   found_fp ? *(unsigned long *)(fp + fp_offset) : fp, callback,
-                   userdata);
-    } else {
-      /* jump to caller's stack. */
-      do_backtrace(sp + frame_size, *(unsigned long *)(sp + ra_offset),
-                   found_fp ? *(unsigned long *)(sp + fp_offset) : fp, callback,
-                   userdata);
-    }
+    base = has_move_s8_sp && sp != fp ? fp : sp;
+    /* jump to caller's stack. */
+    next_sp = base + frame_size;
+    if (!read_stack(base + ra_offset, &next_ra)) return;
+    if (incremental) incremental_slot(incremental, base + ra_offset);
+    if (found_fp && !read_stack(base + fp_offset, &next_fp)) return;
+    /* callers live higher up; only leaving the signal stack may go down */
+    if (next_sp <= sp && !in_stack(&alt_stack, sp)) return;
+    sp = next_sp;
+    ra = next_ra;
+    fp = next_fp;
   }
 }
 
-void backtrace_run(const ucontext_t *ucontext,
-                   void (*callback)(const void *pc, const char *name,
-                                    size_t offset, void *userdata),
-                   void *userdata) {
-  unsigned long sp, ra, fp; /* fp aka s8 */
+/* where to start walking; without a ucontext, in the function inlining this */
+static __always_inline void start_registers(const ucontext_t *ucontext,
+                                            unsigned long *sp,
+                                            unsigned long *ra,
+                                            unsigned long *fp) {
   if (ucontext) {
-    sp = ucontext->uc_mcontext.gregs[29];
-    ra = ucontext->uc_mcontext.gregs[31];
-    fp = ucontext->uc_mcontext.gregs[30];
+    *sp = ucontext->uc_mcontext.gregs[29];
+    *ra = ucontext->uc_mcontext.gregs[31];
+    *fp = ucontext->uc_mcontext.gregs[30];
   } else {
     struct pt_regs regs;
     prepare_frametrace(&regs);
-    sp = regs.regs[29];
-    ra = regs.regs[31];
-    fp = regs.regs[30];
+    *sp = regs.regs[29];
+    *ra = regs.regs[31];
+    *fp = regs.regs[30];
   }
-  do_backtrace(sp, ra, fp, callback, userdata);
 }
 
-/* print back trace functions */
-void show_backtrace() {
-  printf("Call trace:\n");
-  backtrace_run(NULL, unwind_print, NULL);
-  printf("\n");
+/* never inlined, so that captures can count on it being a frame of its own */
+__attribute__((noinline)) void backtrace_run(
+    const ucontext_t *ucontext,
+    void (*callback)(const void *pc, const char *name, size_t offset,
+                     void *userdata),
+    void *userdata) {
+  unsigned long sp, ra, fp; /* fp aka s8 */
+  start_registers(ucontext, &sp, &ra, &fp);
+  do_backtrace(sp, ra, fp, callback, userdata, NULL);
 }
 
-void show_backtrace_ucontext(const ucontext_t *ucontext) {
-  printf("Call trace:\n");
-  backtrace_run(ucontext, unwind_print, NULL);
-  printf("\n");
+struct CaptureData {
+  void **pcs;
+  size_t max;
+  size_t depth;
+  size_t skip;
+};
+
+static void capture_pc(const void *pc, const char *name, size_t offset,
+                       void *userdata) {
+  struct CaptureData *capture = userdata;
+  if (capture->skip) {
+    capture->skip--;
+    return;
+  }
+  if (capture->depth < capture->max)
+    capture->pcs[capture->depth++] = (void *)pc;
+}
+
+__attribute__((noinline)) size_t backtrace_capture(const ucontext_t *ucontext,
+                                                   void **pcs, size_t max,
+                                                   size_t skip) {
+  /* without a ucontext the walk starts in backtrace_run, called from here */
+  struct CaptureData data = {pcs, max, 0, ucontext ? skip : skip + 2};
+  backtrace_run(ucontext, capture_pc, &data);
+  return data.depth;
+}
+
+#define INCREMENTAL_DEPTH 256
+
+struct CachedFrame {
+  unsigned long sp;
+  void *pc;
+  unsigned long ra_slot; /* where the caller's pc was read, 0 if nowhere */
+};
+
+/* the previous incremental capture on this thread, innermost frame first */
+static __thread struct CachedFrame cached_frames[INCREMENTAL_DEPTH];
+static __thread size_t cached_depth;
+static __thread int cache_busy; /* set while a capture uses the cache */
+
+struct IncrementalData {
+  struct CaptureData capture;
+  struct CachedFrame frames[INCREMENTAL_DEPTH]; /* of capture.pcs */
+  unsigned long sp; /* of the frame being reported */
+  int stored;       /* whether that frame went into capture.pcs */
+  size_t cursor;    /* first cached frame not yet passed */
+  int matched;      /* stopped at cached_frames[cursor] */
+  int truncated;    /* stopped with frames left to unwind */
+};
+
+/*
+ * Whether the cached frames from index on are still the live callers. The
+ * sp and pc of a frame do not identify its callers: siblings with equal
+ * frame sizes leave a shared callee at the same sp and pc under either of
+ * them. The return addresses saved in the live frames do.
+ */
+static int cached_suffix_live(size_t index) {
+  for (; index + 1 < cached_depth; index++) {
+    unsigned long saved;
+    if (!cached_frames[index].ra_slot ||
+        !read_stack(cached_frames[index].ra_slot, &saved) ||
+        saved != (unsigned long)cached_frames[index + 1].pc)
+      return 0;
+  }
+  return 1;
+}
+
+static int incremental_stop(struct IncrementalData *incremental,
+                            unsigned long sp, unsigned long ra) {
+  if (incremental->truncated) return 1;
+  incremental->sp = sp;
+  incremental->stored = 0;
+  /* frames still to be skipped must not be replaced by cached ones */
+  if (incremental->capture.skip) return 0;
+  /* both stacks are ordered by sp, so the cursor only moves forward */
+  while (incremental->cursor < cached_depth &&
+         cached_frames[incremental->cursor].sp < sp)
+    incremental->cursor++;
+  if (incremental->cursor < cached_depth &&
+      cached_frames[incremental->cursor].sp == sp &&
+      cached_frames[incremental->cursor].pc == (void *)ra &&
+      cached_suffix_live(incremental->cursor)) {
+    incremental->matched = 1;
+    return 1;
+  }
+  return 0;
+}
+
+static void incremental_slot(struct IncrementalData *incremental,
+                             unsigned long ra_slot) {
+  size_t depth = incremental->capture.depth;
+  if (incremental->stored && depth <= INCREMENTAL_DEPTH)
+    incremental->frames[depth - 1].ra_slot = ra_slot;
+}
+
+static void incremental_pc(const void *pc, const char *name, size_t offset,
+                           void *userdata) {
+  struct IncrementalData *incremental = userdata;
+  struct CaptureData *capture = &incremental->capture;
+  if (capture->skip) {
+    capture->skip--;
+    return;
+  }
+  if (capture->depth == capture->max) {
+    incremental->truncated = 1;
+    return;
+  }
+  if (capture->depth < INCREMENTAL_DEPTH) {
+    incremental->frames[capture->depth].sp = incremental->sp;
+    incremental->frames[capture->depth].ra_slot = 0;
+  }
+  capture->pcs[capture->depth++] = (void *)pc;
+  incremental->stored = 1;
+}
+
+size_t backtrace_capture_incremental(const ucontext_t *ucontext, void **pcs,
+                                     size_t max, size_t skip) {
+  struct IncrementalData data;
+  unsigned long sp, ra, fp;
+  size_t fresh, total, i;
+
+  /* a signal handler interrupted a capture that owns the cache */
+  if (cache_busy || max == 0)
+    return backtrace_capture(ucontext, pcs, max, ucontext ? skip : skip + 1);
+  cache_busy = 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  data.capture.pcs = pcs;
+  data.capture.max = max;
+  data.capture.depth = 0;
+  /* the first frame reported is backtrace_capture_incremental itself */
+  data.capture.skip = ucontext ? skip : skip + 1;
+  data.cursor = 0;
+  data.matched = 0;
+  data.truncated = 0;
+  start_registers(ucontext, &sp, &ra, &fp);
+  do_backtrace(sp, ra, fp, incremental_pc, &data, &data);
+
+  fresh = data.capture.depth;
+  total = fresh;
+  if (data.matched) {
+    size_t suffix = cached_depth - data.cursor;
+    for (i = 0; i < suffix && data.capture.depth < max; i++)
+      pcs[data.capture.depth++] = cached_frames[data.cursor + i].pc;
+    total = fresh + suffix;
+    /* move the shared suffix into place behind the new frames */
+    if (total <= INCREMENTAL_DEPTH)
+      memmove(&cached_frames[fresh], &cached_frames[data.cursor],
+              suffix * sizeof(*cached_frames));
+  }
+  if (data.truncated || total > INCREMENTAL_DEPTH) {
+    /* only a complete stack can serve as the next suffix */
+    cached_depth = 0;
+  } else {
+    for (i = 0; i < fresh; i++) {
+      cached_frames[i] = data.frames[i];
+      cached_frames[i].pc = pcs[i];
+    }
+    cached_depth = total;
+  }
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  cache_busy = 0;
+  return data.capture.depth;
 }
 
 #else
@@ -235,16 +469,6 @@ static _Unwind_Reason_Code unwind_wrapper(struct _Unwind_Context *context,
   return _URC_NO_REASON;
 }
 
-void show_backtrace() {
-  printf("Call trace:\n");
-  backtrace_run(NULL, unwind_print, NULL);
-  printf("\n");
-}
-
-void show_backtrace_ucontext(const struct ucontext *ucontext) {
-  show_backtrace();
-}
-
 void backtrace_run(const ucontext_t *ucontext,
                    void (*callback)(const void *pc, const char *name,
                                     size_t offset, void *userdata),
@@ -253,4 +477,223 @@ void backtrace_run(const ucontext_t *ucontext,
   _Unwind_Backtrace(unwind_wrapper, &data);
 }
 
+struct CaptureData {
+  void **pcs;
+  size_t max;
+  size_t depth;
+  size_t skip;
+  const void *start;
+};
+
+/* pc of the interrupted instruction, NULL if unknown on this arch */
+static const void *ucontext_pc(const ucontext_t *ucontext) {
+#if defined(__x86_64__)
+  return (const void *)ucontext->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+  return (const void *)ucontext->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+  return (const void *)ucontext->uc_mcontext.pc;
+#elif defined(__arm__)
+  return (const void *)ucontext->uc_mcontext.arm_pc;
+#else
+  return NULL;
+#endif
+}
+
+/* whether the frame at ip is wanted, once start and skip are accounted for */
+static int capture_wanted(struct CaptureData *capture, const void *ip) {
+  /* drop handler and trampoline frames above the interrupted one */
+  if (capture->start) {
+    if (ip != capture->start) return 0;
+    capture->start = NULL;
+  }
+  if (capture->skip) {
+    capture->skip--;
+    return 0;
+  }
+  return 1;
+}
+
+static _Unwind_Reason_Code capture_wrapper(struct _Unwind_Context *context,
+                                           void *data) {
+  struct CaptureData *capture = data;
+  const void *ip = (const void *)_Unwind_GetIP(context);
+  if (!ip) return _URC_END_OF_STACK;
+  if (!capture_wanted(capture, ip)) return _URC_NO_REASON;
+  capture->pcs[capture->depth++] = (void *)ip;
+  return capture->depth < capture->max ? _URC_NO_REASON : _URC_END_OF_STACK;
+}
+
+size_t backtrace_capture(const ucontext_t *ucontext, void **pcs, size_t max,
+                         size_t skip) {
+  /* the first frame reported is backtrace_capture itself */
+  struct CaptureData data = {pcs, max, 0, skip + 1, NULL};
+  if (max == 0) return 0;
+  if (ucontext) {
+    data.start = ucontext_pc(ucontext);
+    data.skip = skip;
+  }
+  _Unwind_Backtrace(capture_wrapper, &data);
+  if (data.depth == 0 && data.start) {
+    /* interrupted frame not found, keep everything below us */
+    data.start = NULL;
+    data.skip = 1;
+    _Unwind_Backtrace(capture_wrapper, &data);
+  }
+  return data.depth;
+}
+
+#define INCREMENTAL_DEPTH 256
+
+struct CachedFrame {
+  uintptr_t cfa;
+  void *pc;
+};
+
+/* the previous incremental capture on this thread, innermost frame first */
+static __thread struct CachedFrame cached_frames[INCREMENTAL_DEPTH];
+static __thread size_t cached_depth;
+static __thread int cache_busy; /* set while a capture uses the cache */
+
+struct IncrementalData {
+  struct CaptureData capture;
+  uintptr_t cfas[INCREMENTAL_DEPTH]; /* of capture.pcs */
+  size_t cursor;                     /* first cached frame not yet passed */
+  int matched;                       /* stopped at cached_frames[cursor] */
+  int truncated;                     /* stopped with frames left to unwind */
+};
+
+/*
+ * Whether the cached frames from index on are still the live callers. A
+ * frame's CFA and pc do not identify its callers: siblings with equal frame
+ * sizes leave a shared callee at the same CFA and pc under either of them.
+ * The return addresses saved in the live frames do, one load per frame.
+ */
+static int cached_suffix_live(size_t index) {
+#if defined(__x86_64__) || defined(__i386__)
+  /*
+   * The CFA seen with a frame's pc is that of its callee, and the call into
+   * the callee pushed the pc just below it.
+   */
+  for (index++; index < cached_depth; index++)
+    if (*(void *const *)(cached_frames[index].cfa - sizeof(void *)) !=
+        cached_frames[index].pc)
+      return 0;
+  return 1;
+#else
+  /* no fixed return address slot to check, so always unwind in full */
+  return 0;
+#endif
+}
+
+static _Unwind_Reason_Code incremental_wrapper(
+    struct _Unwind_Context *context, void *data) {
+  struct IncrementalData *incremental = data;
+  struct CaptureData *capture = &incremental->capture;
+  const void *ip = (const void *)_Unwind_GetIP(context);
+  uintptr_t cfa;
+  if (!ip) return _URC_END_OF_STACK;
+  if (!capture_wanted(capture, ip)) return _URC_NO_REASON;
+  cfa = _Unwind_GetCFA(context);
+  /* both stacks are ordered by CFA, so the cursor only moves forward */
+  while (incremental->cursor < cached_depth &&
+         cached_frames[incremental->cursor].cfa < cfa)
+    incremental->cursor++;
+  if (incremental->cursor < cached_depth &&
+      cached_frames[incremental->cursor].cfa == cfa &&
+      cached_frames[incremental->cursor].pc == ip &&
+      cached_suffix_live(incremental->cursor)) {
+    incremental->matched = 1;
+    return _URC_END_OF_STACK;
+  }
+  if (capture->depth == capture->max) {
+    incremental->truncated = 1;
+    return _URC_END_OF_STACK;
+  }
+  if (capture->depth < INCREMENTAL_DEPTH)
+    incremental->cfas[capture->depth] = cfa;
+  capture->pcs[capture->depth++] = (void *)ip;
+  return _URC_NO_REASON;
+}
+
+size_t backtrace_capture_incremental(const ucontext_t *ucontext, void **pcs,
+                                     size_t max, size_t skip) {
+  struct IncrementalData data;
+  size_t fresh, total, i;
+
+  /* a signal handler interrupted a capture that owns the cache */
+  if (cache_busy || max == 0)
+    return backtrace_capture(ucontext, pcs, max, ucontext ? skip : skip + 1);
+  cache_busy = 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  data.capture.pcs = pcs;
+  data.capture.max = max;
+  data.capture.depth = 0;
+  /* the first frame reported is backtrace_capture_incremental itself */
+  data.capture.skip = ucontext ? skip : skip + 1;
+  data.capture.start = ucontext ? ucontext_pc(ucontext) : NULL;
+  data.cursor = 0;
+  data.matched = 0;
+  data.truncated = 0;
+  _Unwind_Backtrace(incremental_wrapper, &data);
+  if (data.capture.start) {
+    /* interrupted frame not found, fall back to a plain capture */
+    cached_depth = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    cache_busy = 0;
+    return backtrace_capture(NULL, pcs, max, 1);
+  }
+
+  fresh = data.capture.depth;
+  total = fresh;
+  if (data.matched) {
+    size_t suffix = cached_depth - data.cursor;
+    for (i = 0; i < suffix && data.capture.depth < max; i++)
+      pcs[data.capture.depth++] = cached_frames[data.cursor + i].pc;
+    total = fresh + suffix;
+    /* move the shared suffix into place behind the new frames */
+    if (total <= INCREMENTAL_DEPTH)
+      memmove(&cached_frames[fresh], &cached_frames[data.cursor],
+              suffix * sizeof(*cached_frames));
+  }
+  if (data.truncated || total > INCREMENTAL_DEPTH) {
+    /* only a complete stack can serve as the next suffix */
+    cached_depth = 0;
+  } else {
+    for (i = 0; i < fresh; i++) {
+      cached_frames[i].cfa = data.cfas[i];
+      cached_frames[i].pc = pcs[i];
+    }
+    cached_depth = total;
+  }
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  cache_busy = 0;
+  return data.capture.depth;
+}
+
 #endif
+
+#define SHOW_MAX_DEPTH 64
+
+/* unwind first, so repeated stacks are dropped before any symbolization */
+static __attribute__((noinline)) void show_stack(const ucontext_t *ucontext) {
+  void *pcs[SHOW_MAX_DEPTH];
+  size_t depth =
+      backtrace_capture(ucontext, pcs, SHOW_MAX_DEPTH, ucontext ? 0 : 1);
+  if (!backtrace_dedup_admit(pcs, depth)) return;
+  if (ucontext) backtrace_signal_enter();
+  backtrace_write_pcs(STDOUT_FILENO, BACKTRACE_FORMAT_TEXT,
+                      (const void *const *)pcs, depth, 1);
+  if (ucontext) backtrace_signal_leave();
+}
+
+/* print back trace functions */
+void show_backtrace() {
+  fflush(stdout);
+  show_stack(NULL);
+}
+
+void show_backtrace_ucontext(const ucontext_t *ucontext) {
+  show_stack(ucontext);
+}
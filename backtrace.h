@@ -1,8 +1,14 @@
 #ifndef __BACKTRACE_H
 #define __BACKTRACE_H
 #include <asm/ptrace.h>  //for struct pt_regs
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <ucontext.h>
 
+/* real-time signal reserved by backtrace_all_threads() */
+#define BACKTRACE_ALL_THREADS_SIGNAL (SIGRTMIN + 3)
+
 /*
  * Major opcodes; before MIPS IV cop1x was called cop3.
  */
@@ -333,8 +339,46 @@ union mips_instruction {
 #ifdef __cplusplus
 extern "C" {
 #endif
+enum backtrace_init_mode {
+  BACKTRACE_INIT_LAZY,  /* build the symbol index on the first lookup */
+  BACKTRACE_INIT_SYNC,  /* build it now, before returning */
+  BACKTRACE_INIT_ASYNC, /* build it on a background thread */
+  /* or-ed with SYNC or ASYNC: also load every separate debug file then */
+  BACKTRACE_INIT_DEBUG_FILES = 4,
+};
+/**
+ * choose when the symbol index is built; without a call it is built lazily
+ *
+ * While a BACKTRACE_INIT_ASYNC build is running, lookups do not wait for it:
+ * addr_to_name() returns null and traces show raw addresses.
+ * Separate debug files are otherwise loaded on a module's first lookup, but
+ * never from show_backtrace_ucontext(), backtrace_write() with a ucontext or
+ * the alternate signal stack; those use the dynamic symbols until then.
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_init(int mode);
+/* non-zero once the symbol index has been built */
+int backtrace_ready();
 const char *addr_to_name(const void *addr);
 size_t addr_to_offset(const void *addr);
+/**
+ * add JIT symbols from a perf map file; calling it again for the same path
+ * only reads the entries appended since the previous call
+ * @param path map file, null for /tmp/perf-<pid>.map
+ * @return number of entries added, -errno on failure
+ */
+int backtrace_load_perf_map(const char *path);
+/**
+ * name a range of JIT code for addr_to_name(); registering the same begin
+ * again replaces the previous name
+ */
+void backtrace_register_code(const void *begin, size_t size, const char *name);
+/**
+ * symbol cache counters of the calling thread
+ * @param hits lookups answered from the cache, may be null
+ * @param misses lookups that searched the symbol index, may be null
+ */
+void backtrace_cache_stats(uint64_t *hits, uint64_t *misses);
 /**
  * backtrace stack
  * @param ucontext use ucontext stack if not null
@@ -345,8 +389,183 @@ void backtrace_run(const ucontext_t *ucontext,
                    void (*callback)(const void *pc, const char *name,
                                     size_t offset, void *userdata),
                    void *userdata);
+/**
+ * capture raw return addresses without symbolizing them
+ * @param ucontext start from the interrupted frame if not null
+ * @param pcs output array
+ * @param max capacity of pcs
+ * @param skip number of innermost frames to drop
+ * @return number of frames stored in pcs
+ */
+size_t backtrace_capture(const ucontext_t *ucontext, void **pcs, size_t max,
+                         size_t skip);
+/**
+ * like backtrace_capture, but remembers the calling thread's last stack and
+ * stops unwinding at the first frame it shares with it (same CFA, or sp on
+ * MIPS, and pc, and every return address saved further out unchanged),
+ * reusing the rest. Meant for repeated sampling of deep, stable stacks; on
+ * targets other than x86 and MIPS it always unwinds in full.
+ * @param ucontext start from the interrupted frame if not null
+ * @param pcs output array
+ * @param max capacity of pcs
+ * @param skip number of innermost frames to drop
+ * @return number of frames stored in pcs
+ */
+size_t backtrace_capture_incremental(const ucontext_t *ucontext, void **pcs,
+                                     size_t max, size_t skip);
 void show_backtrace();
 void show_backtrace_ucontext(const ucontext_t *ucontext);
+
+enum backtrace_format {
+  BACKTRACE_FORMAT_TEXT,   /* "Call trace:" followed by one frame per line */
+  BACKTRACE_FORMAT_JSON,   /* one JSON object per line */
+  BACKTRACE_FORMAT_FOLDED, /* root;...;leaf weight, for flamegraphs */
+};
+/**
+ * format captured pcs into a fixed stack buffer and write it to fd, normally
+ * with a single write(2), without stdio. Symbolizing allocates only while
+ * the symbol index is built; inside a signal handler an index that is not
+ * built yet is not built there, and frames are written as raw addresses
+ * @param fd destination file descriptor
+ * @param format output format
+ * @param pcs frames as returned by backtrace_capture()
+ * @param depth number of frames
+ * @param weight sample count reported by the JSON and folded formats
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_write_pcs(int fd, enum backtrace_format format,
+                        const void *const *pcs, size_t depth,
+                        unsigned long weight);
+/**
+ * capture the current stack and write it with backtrace_write_pcs()
+ * @param ucontext use ucontext stack if not null
+ */
+int backtrace_write(int fd, enum backtrace_format format,
+                    const ucontext_t *ucontext);
+enum backtrace_thread_status {
+  BACKTRACE_THREAD_NO_RESPONSE, /* did not answer within timeout_ms */
+  BACKTRACE_THREAD_NO_FRAMES,   /* answered, but nothing could be unwound */
+};
+/**
+ * snapshot the stack of every thread in the process without stopping it
+ *
+ * Each thread is sent BACKTRACE_ALL_THREADS_SIGNAL and records its own stack
+ * from the signal ucontext; the caller then symbolizes the results. Threads
+ * that do not answer within timeout_ms, or answer without a single frame,
+ * are reported once with a null pc and a backtrace_thread_status as offset.
+ * @param timeout_ms limit on signalling and waiting, counted from the call;
+ *                   threads still capturing then count as not answering
+ * @param callback called for every frame of every thread, in tid order
+ * @param userdata
+ * @return number of threads that answered, -1 on error
+ */
+int backtrace_all_threads(int timeout_ms,
+                          void (*callback)(pid_t tid, const void *pc,
+                                           const char *name, size_t offset,
+                                           void *userdata),
+                          void *userdata);
+void show_backtrace_all_threads();
+/**
+ * report where the exception currently being handled was thrown
+ *
+ * Throw sites are recorded as raw pcs by an interposed __cxa_throw, which is
+ * only built with the BACKTRACE_EXCEPTION_STACK option (without it this
+ * always returns -1); frames are symbolized here, when asked for.
+ * @param callback called for every frame, throw site first
+ * @param userdata
+ * @return 0 if the stack was found, -1 otherwise
+ */
+int backtrace_current_exception_stack(
+    void (*callback)(const void *pc, const char *name, size_t offset,
+                     void *userdata),
+    void *userdata);
+/**
+ * let show_backtrace() print each distinct stack only once per window; the
+ * raw stack is hashed before symbolizing and repeats are only counted
+ * @param window_ms window length, 0 to print every stack
+ */
+void backtrace_set_dedup_window(unsigned window_ms);
+/**
+ * decide whether a captured stack should be reported now, counting it as a
+ * suppressed repeat otherwise; always non-zero while dedup is disabled
+ */
+int backtrace_dedup_admit(void *const *pcs, size_t depth);
+/**
+ * write every stack with repeats suppressed since the previous report,
+ * weighted by their number
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_dedup_report(int fd, enum backtrace_format format);
+/**
+ * start sampling allocations, about one per interval bytes allocated
+ *
+ * The profiler replaces malloc/free and friends, which is only done with the
+ * BACKTRACE_HEAP_PROFILER option; without it this and the dump functions
+ * return -ENOSYS.
+ * @param interval mean sampling interval in bytes, 0 for 512 KiB
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_heap_profiler_start(size_t interval);
+void backtrace_heap_profiler_stop();
+/**
+ * write the estimated bytes still in use for every sampled stack
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_heap_profile_dump(int fd, enum backtrace_format format);
+/**
+ * dump the heap profile from a background thread every given seconds
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_heap_profile_dump_every(int fd, enum backtrace_format format,
+                                      unsigned seconds);
+/**
+ * start recording stacks that waited at least threshold_ns for a contended
+ * pthread mutex or rwlock; the lock interposers are only built with the
+ * BACKTRACE_MUTEX_PROFILER option
+ * @return 0 on success, -ENOSYS without the option, as does the dump
+ */
+int backtrace_mutex_profiler_start(uint64_t threshold_ns);
+void backtrace_mutex_profiler_stop();
+/**
+ * write the total nanoseconds waited for every recorded stack
+ * @return 0 on success, -errno on failure
+ */
+int backtrace_mutex_profile_dump(int fd, enum backtrace_format format);
+struct backtrace_module {
+  const char *path;
+  uintptr_t base; /* load bias: pc - base is the link-time address */
+  const unsigned char *build_id;
+  size_t build_id_size;
+};
+size_t backtrace_module_count();
+int backtrace_module_get(size_t index, struct backtrace_module *module);
+/**
+ * find the loaded module containing pc
+ * @param index index for backtrace_module_get()
+ * @param offset pc relative to the module's load bias
+ * @return 0 on success, -1 if pc is not inside any module
+ */
+int backtrace_module_of(const void *pc, size_t *index, uintptr_t *offset);
+
+#define BACKTRACE_NO_MODULE UINT32_MAX
+struct backtrace_frame_ref {
+  uint32_t module; /* BACKTRACE_NO_MODULE if offset is a raw pc */
+  uintptr_t offset;
+};
+/**
+ * encode pcs as varint-delta (module index, module offset) pairs that stay
+ * meaningful outside the process, given the module table
+ * @return bytes written, 0 if out is too small
+ */
+size_t backtrace_encode(const void *const *pcs, size_t depth,
+                        unsigned char *out, size_t size);
+/**
+ * decode a stack produced by backtrace_encode()
+ * @param frames receives at most max frames
+ * @return depth of the encoded stack, 0 if the input is malformed
+ */
+size_t backtrace_decode(const unsigned char *in, size_t size,
+                        struct backtrace_frame_ref *frames, size_t max);
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "Elf.h"
+#include "backtrace.h"
+
+// Symbolizes a handful of captured stacks over and over, as a profiler
+// reporting its hot code paths does, with and without the per-thread lookup
+// cache. Every frame of every stack is a distinct function, so the cache
+// sees a few hundred pcs rather than one return address repeated.
+
+static const int kRounds = 20000;
+static const int kStacks = 8;
+static const int kLevels = 32;
+static const size_t kMaxDepth = kLevels + 16;
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// One function per (stack, level); the asm operand keeps the bodies apart so
+// identical code folding cannot merge them.
+template <int Stack, int Level>
+struct Descend {
+  __attribute__((noinline)) static size_t Run(void** pcs) {
+    size_t captured = Descend<Stack, Level - 1>::Run(pcs);
+    asm volatile("" ::"r"(Stack * kLevels + Level));
+    return captured;
+  }
+};
+
+template <int Stack>
+struct Descend<Stack, 0> {
+  __attribute__((noinline)) static size_t Run(void** pcs) {
+    size_t captured = backtrace_capture(NULL, pcs, kMaxDepth, 0);
+    asm volatile("" ::"r"(Stack));
+    return captured;
+  }
+};
+
+static size_t (*const kCapture[kStacks])(void**) = {
+    Descend<0, kLevels>::Run, Descend<1, kLevels>::Run,
+    Descend<2, kLevels>::Run, Descend<3, kLevels>::Run,
+    Descend<4, kLevels>::Run, Descend<5, kLevels>::Run,
+    Descend<6, kLevels>::Run, Descend<7, kLevels>::Run,
+};
+
+int main() {
+  backtrace_init(BACKTRACE_INIT_SYNC);
+  void* pcs[kStacks][kMaxDepth];
+  size_t depth[kStacks];
+  size_t frames = 0;
+  for (int s = 0; s < kStacks; s++) frames += depth[s] = kCapture[s](pcs[s]);
+  size_t sink = 0;
+
+  // what a symbolizing profiler asks per frame: name, offset and module
+  double start = now_ns();
+  for (int round = 0; round < kRounds; round++)
+    for (int s = 0; s < kStacks; s++)
+      for (size_t i = 0; i < depth[s]; i++) {
+        size_t index;
+        uintptr_t offset;
+        sink += addr_to_offset(pcs[s][i]) + (addr_to_name(pcs[s][i]) != NULL);
+        sink += backtrace_module_of(pcs[s][i], &index, &offset) == 0;
+      }
+  double cached = (now_ns() - start) / kRounds / frames;
+
+  backtrace::Elf& elf = backtrace::Elf::Instance();
+  start = now_ns();
+  for (int round = 0; round < kRounds; round++)
+    for (int s = 0; s < kStacks; s++)
+      for (size_t i = 0; i < depth[s]; i++) {
+        // what the same three calls cost before the cache
+        backtrace::Function* name = elf.Locate(pcs[s][i]);
+        backtrace::Function* offset = elf.Locate(pcs[s][i]);
+        sink += (name != NULL) + (offset != NULL);
+        sink += elf.LocateModule(pcs[s][i]) >= 0;
+      }
+  double uncached = (now_ns() - start) / kRounds / frames;
+
+  uint64_t hits, misses;
+  backtrace_cache_stats(&hits, &misses);
+  printf("%d stacks, %zu frames x %d rounds\n", kStacks, frames, kRounds);
+  printf("cached:   %.1f ns/frame (%llu hits, %llu misses)\n", cached,
+         (unsigned long long)hits, (unsigned long long)misses);
+  printf("uncached: %.1f ns/frame\n", uncached);
+  return sink == 0;
+}
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backtrace.h"
+#include "stack_hash.h"
+
+/*
+ * Lock-free table of recently reported stacks. Every operation is a handful
+ * of atomics, so it is safe from signal handlers and cheap during log storms.
+ * A slot's pcs are guarded by a sequence number, odd while they are being
+ * written; once its window has passed and its repeats were reported, a slot
+ * may be rewritten for another stack.
+ */
+
+#define DEDUP_SLOTS 256
+#define DEDUP_PROBES 16
+#define DEDUP_DEPTH 64
+
+struct DedupSlot {
+  uint64_t seq;        /* odd while the slot is being written */
+  uint64_t hash;       /* 0 if the slot was never used */
+  uint64_t window;     /* window the stack was last printed in */
+  uint64_t suppressed; /* repeats not printed since the last report */
+  size_t depth;
+  void *pcs[DEDUP_DEPTH];
+};
+
+/* 0 disables deduplication */
+static unsigned dedup_window_ms;
+static struct DedupSlot dedup_slots[DEDUP_SLOTS];
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* whether the slot holds this stack, as of sequence number seq */
+static bool slot_matches(struct DedupSlot *slot, uint64_t seq,
+                         void *const *pcs, size_t depth, uint64_t hash) {
+  size_t i;
+  if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash ||
+      __atomic_load_n(&slot->depth, __ATOMIC_RELAXED) != depth)
+    return false;
+  for (i = 0; i < depth && i < DEDUP_DEPTH; i++)
+    if (__atomic_load_n(&slot->pcs[i], __ATOMIC_RELAXED) != pcs[i])
+      return false;
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq;
+}
+
+/* take over a free or stale slot seen at sequence number *seq */
+static struct DedupSlot *claim_slot(struct DedupSlot *slot, uint64_t *seq,
+                                    void *const *pcs, size_t depth,
+                                    uint64_t hash, uint64_t window) {
+  size_t i;
+  uint64_t expected = *seq;
+  if (!__atomic_compare_exchange_n(&slot->seq, &expected, expected + 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return NULL;
+  __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->depth, depth, __ATOMIC_RELAXED);
+  for (i = 0; i < depth && i < DEDUP_DEPTH; i++)
+    __atomic_store_n(&slot->pcs[i], pcs[i], __ATOMIC_RELAXED);
+  /* the claimer prints the stack, so this window has had its print */
+  __atomic_store_n(&slot->window, window, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->suppressed, 0, __ATOMIC_RELAXED);
+  *seq = expected + 2;
+  __atomic_store_n(&slot->seq, *seq, __ATOMIC_RELEASE);
+  return slot;
+}
+
+/*
+ * the slot holding this stack as of *seq; *claimed is set if it was taken
+ * over for it just now, meaning this is the stack's first occurrence
+ */
+static struct DedupSlot *find_slot(void *const *pcs, size_t depth,
+                                   uint64_t hash, uint64_t window,
+                                   uint64_t *seq, bool *claimed) {
+  struct DedupSlot *stale = NULL;
+  uint64_t stale_seq = 0;
+  size_t i;
+  *claimed = true;
+  for (i = 0; i < DEDUP_PROBES; i++) {
+    struct DedupSlot *slot = &dedup_slots[(hash + i) % DEDUP_SLOTS];
+    *seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (*seq & 1) continue; /* being rewritten */
+    /* slots never become free again, so the stack cannot be further on */
+    if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == 0) {
+      if (stale) {
+        *seq = stale_seq;
+        slot = stale;
+      }
+      return claim_slot(slot, seq, pcs, depth, hash, window);
+    }
+    if (slot_matches(slot, *seq, pcs, depth, hash)) {
+      *claimed = false;
+      return slot;
+    }
+    if (!stale &&
+        __atomic_load_n(&slot->window, __ATOMIC_RELAXED) != window &&
+        __atomic_load_n(&slot->suppressed, __ATOMIC_RELAXED) == 0) {
+      stale = slot;
+      stale_seq = *seq;
+    }
+  }
+  *seq = stale_seq;
+  return stale ? claim_slot(stale, seq, pcs, depth, hash, window) : NULL;
+}
+
+void backtrace_set_dedup_window(unsigned window_ms) {
+  __atomic_store_n(&dedup_window_ms, window_ms, __ATOMIC_RELEASE);
+}
+
+int backtrace_dedup_admit(void *const *pcs, size_t depth) {
+  unsigned window_ms = __atomic_load_n(&dedup_window_ms, __ATOMIC_ACQUIRE);
+  uint64_t hash, window, seen, seq;
+  struct DedupSlot *slot;
+  bool claimed;
+
+  if (window_ms == 0) return 1;
+  hash = stack_hash(pcs, depth);
+  if (hash == 0) hash = 1;
+  window = now_ms() / window_ms + 1;
+  slot = find_slot(pcs, depth, hash, window, &seq, &claimed);
+  /* a new stack, or no room: never hide a new stack */
+  if (!slot || claimed) return 1;
+  seen = __atomic_load_n(&slot->window, __ATOMIC_ACQUIRE);
+  if (seen != window &&
+      __atomic_compare_exchange_n(&slot->window, &seen, window, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+  /* taken over for another stack since it matched: this is no repeat */
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) return 1;
+  __atomic_add_fetch(&slot->suppressed, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int backtrace_dedup_report(int fd, enum backtrace_format format) {
+  void *pcs[DEDUP_DEPTH];
+  size_t i, j, depth;
+  int ret = 0;
+  for (i = 0; i < DEDUP_SLOTS && ret == 0; i++) {
+    struct DedupSlot *slot = &dedup_slots[i];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE), total;
+    if ((seq & 1) || !__atomic_load_n(&slot->suppressed, __ATOMIC_RELAXED))
+      continue;
+    depth = __atomic_load_n(&slot->depth, __ATOMIC_RELAXED);
+    if (depth > DEDUP_DEPTH) depth = DEDUP_DEPTH;
+    for (j = 0; j < depth; j++)
+      pcs[j] = __atomic_load_n(&slot->pcs[j], __ATOMIC_RELAXED);
+    /* once drained, the slot may be reused after its window */
+    total = __atomic_exchange_n(&slot->suppressed, 0, __ATOMIC_ACQ_REL);
+    if (total == 0 || __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+      continue;
+    if (format == BACKTRACE_FORMAT_TEXT) {
+      char header[64];
+      int n = snprintf(header, sizeof(header), "%llu repeats suppressed of\n",
+                       (unsigned long long)total);
+      if (write(fd, header, n) != n) return -errno;
+    }
+    ret = backtrace_write_pcs(fd, format, (const void *const *)pcs, depth,
+                              (unsigned long)total);
+  }
+  return ret;
+}
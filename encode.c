@@ -0,0 +1,94 @@
+#include <stdint.h>
+
+#include "backtrace.h"
+
+/*
+ * Stack encoding:
+ *   varint depth
+ *   per frame: varint (zigzag(offset - previous offset) << 1 | new module)
+ *              varint (module index + 1), only if the module changed
+ * Offsets are module-relative; module 0 (no module) carries the raw pc.
+ * The previous offset restarts at 0 whenever the module changes.
+ */
+
+static size_t put_varint(unsigned char *out, size_t size, size_t used,
+                         uint64_t value) {
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    if (used == size) return 0;
+    out[used++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return used;
+}
+
+static size_t get_varint(const unsigned char *in, size_t size, size_t used,
+                         uint64_t *value) {
+  int shift = 0;
+  *value = 0;
+  do {
+    if (used == size || shift > 63) return 0;
+    *value |= (uint64_t)(in[used] & 0x7f) << shift;
+    shift += 7;
+  } while (in[used++] & 0x80);
+  return used;
+}
+
+size_t backtrace_encode(const void *const *pcs, size_t depth,
+                        unsigned char *out, size_t size) {
+  uint64_t previous_module = 1; /* the executable */
+  uintptr_t previous_offset = 0;
+  size_t used, i;
+
+  used = put_varint(out, size, 0, depth);
+  for (i = 0; i < depth && used; i++) {
+    size_t index;
+    uintptr_t offset;
+    uint64_t module, delta;
+    if (backtrace_module_of(pcs[i], &index, &offset) == 0) {
+      module = index + 1;
+    } else {
+      module = 0;
+      offset = (uintptr_t)pcs[i];
+    }
+    if (module != previous_module) previous_offset = 0;
+    delta = (uint64_t)offset - previous_offset;
+    delta = (delta << 1) ^ (uint64_t)((int64_t)delta >> 63); /* zigzag */
+    used = put_varint(out, size, used,
+                      delta << 1 | (module != previous_module));
+    if (used && module != previous_module)
+      used = put_varint(out, size, used, module);
+    previous_module = module;
+    previous_offset = offset;
+  }
+  return used;
+}
+
+size_t backtrace_decode(const unsigned char *in, size_t size,
+                        struct backtrace_frame_ref *frames, size_t max) {
+  uint64_t depth, previous_module = 1, value;
+  uintptr_t previous_offset = 0;
+  size_t used, i;
+
+  used = get_varint(in, size, 0, &depth);
+  if (!used) return 0;
+  for (i = 0; i < depth; i++) {
+    uint64_t module = previous_module, delta;
+    used = get_varint(in, size, used, &value);
+    if (!used) return 0;
+    if (value & 1) {
+      used = get_varint(in, size, used, &module);
+      if (!used) return 0;
+      previous_offset = 0;
+    }
+    delta = value >> 1;
+    delta = (delta >> 1) ^ (0 - (delta & 1)); /* zigzag */
+    previous_offset += (uintptr_t)delta;
+    previous_module = module;
+    if (i < max) {
+      frames[i].module = module ? (uint32_t)(module - 1) : BACKTRACE_NO_MODULE;
+      frames[i].offset = previous_offset;
+    }
+  }
+  return depth;
+}
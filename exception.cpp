@@ -0,0 +1,85 @@
+#include <dlfcn.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <typeinfo>
+
+#include "backtrace.h"
+
+#ifdef BACKTRACE_EXCEPTION_STACK
+
+namespace {
+constexpr size_t kMaxDepth = 32;
+constexpr size_t kHistory = 8;
+
+struct ThrowRecord {
+  const void* object;
+  size_t depth;
+  void* pcs[kMaxDepth];
+};
+
+// Most recent throws of this thread. Plain data so that thread_local needs
+// no dynamic initialization on the throw path.
+struct ThrowHistory {
+  ThrowRecord records[kHistory];
+  size_t next;
+};
+thread_local ThrowHistory history;
+
+typedef void (*CxaThrow)(void*, std::type_info*, void (*)(void*));
+
+const void* CurrentExceptionObject() {
+  std::exception_ptr current = std::current_exception();
+  const void* object = nullptr;
+  static_assert(sizeof(current) == sizeof(object),
+                "exception_ptr is expected to wrap the thrown object");
+  if (current) memcpy(&object, &current, sizeof(object));
+  return object;
+}
+}  // namespace
+
+extern "C" {
+// Records raw pcs only; symbolization is left to whoever asks for them.
+void __cxa_throw(void* object, std::type_info* type,
+                 void (*destructor)(void*)) {
+  static CxaThrow next =
+      reinterpret_cast<CxaThrow>(dlsym(RTLD_NEXT, "__cxa_throw"));
+  ThrowRecord& record = history.records[history.next++ % kHistory];
+  record.object = object;
+  record.depth = backtrace_capture(nullptr, record.pcs, kMaxDepth, 1);
+  if (!next) abort();
+  next(object, type, destructor);
+  __builtin_unreachable();
+}
+
+int backtrace_current_exception_stack(
+    void (*callback)(const void* pc, const char* name, size_t offset,
+                     void* userdata),
+    void* userdata) {
+  const void* object = CurrentExceptionObject();
+  if (!object) return -1;
+  for (size_t i = 1; i <= kHistory && i <= history.next; i++) {
+    const ThrowRecord& record =
+        history.records[(history.next - i) % kHistory];
+    if (record.object != object) continue;
+    for (size_t j = 0; callback && j < record.depth; j++)
+      callback(record.pcs[j], addr_to_name(record.pcs[j]),
+               addr_to_offset(record.pcs[j]), userdata);
+    return 0;
+  }
+  return -1;
+}
+}
+
+#else
+
+// Built without BACKTRACE_EXCEPTION_STACK: throws are not recorded.
+int backtrace_current_exception_stack(
+    void (*callback)(const void* pc, const char* name, size_t offset,
+                     void* userdata),
+    void* userdata) {
+  return -1;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "backtrace.h"
+#include "signal_context.h"
+
+#define FORMAT_BUFFER_SIZE 4096
+#define FORMAT_MAX_DEPTH 64
+
+/* fixed-size output buffer, flushed with write(2) only when full or done */
+struct Writer {
+  int fd;
+  int error;
+  size_t used;
+  char buffer[FORMAT_BUFFER_SIZE];
+};
+
+static void writer_flush(struct Writer *writer) {
+  const char *p = writer->buffer;
+  size_t left = writer->used;
+  while (left > 0 && !writer->error) {
+    ssize_t n = write(writer->fd, p, left);
+    if (n < 0) {
+      if (errno != EINTR) writer->error = errno;
+      continue;
+    }
+    p += n;
+    left -= (size_t)n;
+  }
+  writer->used = 0;
+}
+
+static void put_char(struct Writer *writer, char c) {
+  if (writer->used == sizeof(writer->buffer)) writer_flush(writer);
+  writer->buffer[writer->used++] = c;
+}
+
+static void put_str(struct Writer *writer, const char *s) {
+  while (*s) put_char(writer, *s++);
+}
+
+static void put_dec(struct Writer *writer, unsigned long value) {
+  char digits[24];
+  int n = 0;
+  do {
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (n) put_char(writer, digits[--n]);
+}
+
+static void put_hex(struct Writer *writer, uintptr_t value) {
+  static const char hex[] = "0123456789abcdef";
+  char digits[2 * sizeof(value)];
+  int n = 0;
+  do {
+    digits[n++] = hex[value & 0xf];
+    value >>= 4;
+  } while (value);
+  put_str(writer, "0x");
+  while (n) put_char(writer, digits[--n]);
+}
+
+static void put_json_str(struct Writer *writer, const char *s) {
+  static const char hex[] = "0123456789abcdef";
+  put_char(writer, '"');
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') {
+      put_char(writer, '\\');
+      put_char(writer, (char)c);
+    } else if (c < 0x20) {
+      put_str(writer, "\\u00");
+      put_char(writer, hex[c >> 4]);
+      put_char(writer, hex[c & 0xf]);
+    } else {
+      put_char(writer, (char)c);
+    }
+  }
+  put_char(writer, '"');
+}
+
+/* function name, or the raw address if it cannot be symbolized */
+static void put_frame_name(struct Writer *writer, const void *pc) {
+  const char *name = addr_to_name(pc);
+  if (name)
+    put_str(writer, name);
+  else
+    put_hex(writer, (uintptr_t)pc);
+}
+
+static void format_text(struct Writer *writer, const void *const *pcs,
+                        size_t depth) {
+  size_t i;
+  put_str(writer, "Call trace:\n");
+  for (i = 0; i < depth; i++) {
+    const char *name = addr_to_name(pcs[i]);
+    put_str(writer, "\t=>");
+    if (name) {
+      put_str(writer, name);
+      put_str(writer, "()+");
+      put_hex(writer, addr_to_offset(pcs[i]));
+    } else {
+      put_hex(writer, (uintptr_t)pcs[i]);
+    }
+    put_char(writer, '\n');
+  }
+  put_char(writer, '\n');
+}
+
+static void format_json(struct Writer *writer, const void *const *pcs,
+                        size_t depth, unsigned long weight) {
+  size_t i;
+  put_str(writer, "{\"weight\":");
+  put_dec(writer, weight);
+  put_str(writer, ",\"frames\":[");
+  for (i = 0; i < depth; i++) {
+    const char *name = addr_to_name(pcs[i]);
+    if (i) put_char(writer, ',');
+    put_str(writer, "{\"pc\":\"");
+    put_hex(writer, (uintptr_t)pcs[i]);
+    put_str(writer, "\",\"name\":");
+    if (name)
+      put_json_str(writer, name);
+    else
+      put_str(writer, "null");
+    put_str(writer, ",\"offset\":");
+    put_dec(writer, addr_to_offset(pcs[i]));
+    put_char(writer, '}');
+  }
+  put_str(writer, "]}\n");
+}
+
+/* root first, frames separated by ';', then the sample weight */
+static void format_folded(struct Writer *writer, const void *const *pcs,
+                          size_t depth, unsigned long weight) {
+  size_t i;
+  for (i = depth; i > 0; i--) {
+    put_frame_name(writer, pcs[i - 1]);
+    if (i > 1) put_char(writer, ';');
+  }
+  put_char(writer, ' ');
+  put_dec(writer, weight);
+  put_char(writer, '\n');
+}
+
+int backtrace_write_pcs(int fd, enum backtrace_format format,
+                        const void *const *pcs, size_t depth,
+                        unsigned long weight) {
+  struct Writer writer;
+  writer.fd = fd;
+  writer.error = 0;
+  writer.used = 0;
+  switch (format) {
+    case BACKTRACE_FORMAT_TEXT:
+      format_text(&writer, pcs, depth);
+      break;
+    case BACKTRACE_FORMAT_JSON:
+      format_json(&writer, pcs, depth, weight);
+      break;
+    case BACKTRACE_FORMAT_FOLDED:
+      format_folded(&writer, pcs, depth, weight);
+      break;
+    default:
+      return -EINVAL;
+  }
+  writer_flush(&writer);
+  return -writer.error;
+}
+
+int backtrace_write(int fd, enum backtrace_format format,
+                    const ucontext_t *ucontext) {
+  void *pcs[FORMAT_MAX_DEPTH];
+  size_t depth = backtrace_capture(ucontext, pcs, FORMAT_MAX_DEPTH,
+                                   ucontext ? 0 : 1);
+  int ret;
+  if (ucontext) backtrace_signal_enter();
+  ret = backtrace_write_pcs(fd, format, (const void *const *)pcs, depth, 1);
+  if (ucontext) backtrace_signal_leave();
+  return ret;
+}
@@ -0,0 +1,317 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "backtrace.h"
+#include "stack_table.h"
+
+#ifdef BACKTRACE_HEAP_PROFILER
+
+/*
+ * Sampling heap profiler. The allocator entry points below replace the libc
+ * ones when this file is linked into the executable; glibc's __libc_*
+ * functions do the real work. C++ operator new/delete reach them through
+ * malloc/free.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define HEAP_DEFAULT_INTERVAL (512 * 1024)
+#define HEAP_STACKS 4096
+
+#define HEAP_TLS __thread __attribute__((tls_model("initial-exec")))
+
+/*
+ * A sampled block is allocated with room for a header in front of it, and
+ * the word right below the returned pointer holds SAMPLE_MAGIC. For any
+ * other block that word is glibc's chunk size, which never has all three
+ * flag bits set, so free() can tell the two apart from memory it is about
+ * to touch anyway.
+ */
+#define SAMPLE_MAGIC ((size_t)0xfee1deadfee1dea7ULL)
+#define SAMPLE_HEADER 32
+
+struct SampleHeader {
+  void *base;               /* what the __libc_* allocator returned */
+  struct StackEntry *stack; /* null if the stack table was full */
+  int64_t bytes;            /* weight added to stack */
+};
+
+typedef size_t (*UsableSizeFunction)(void *ptr);
+
+/* 0 while the profiler is stopped */
+static size_t sample_interval;
+static struct StackTable heap_stacks = STACK_TABLE_INITIALIZER(HEAP_STACKS);
+static UsableSizeFunction next_usable_size;
+
+/* bytes left before this thread takes its next sample */
+static HEAP_TLS int64_t bytes_until_sample;
+static HEAP_TLS uint64_t sample_seed;
+/* set while the profiler itself runs, so its own allocations are ignored */
+static HEAP_TLS int in_profiler;
+
+static __attribute__((constructor)) void resolve_usable_size() {
+  next_usable_size = (UsableSizeFunction)dlsym(RTLD_NEXT, "malloc_usable_size");
+}
+
+/* exponentially distributed gap, so samples form a Poisson process in bytes */
+static int64_t next_sample_gap(size_t interval) {
+  double uniform;
+  if (sample_seed == 0)
+    sample_seed = ((uint64_t)syscall(SYS_gettid) << 32) ^ (uintptr_t)&uniform;
+  sample_seed ^= sample_seed >> 12;
+  sample_seed ^= sample_seed << 25;
+  sample_seed ^= sample_seed >> 27;
+  uniform = ((sample_seed * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+  return (int64_t)(-log(1.0 - uniform) * (double)interval) + 1;
+}
+
+static inline int is_sampled(const void *ptr) {
+  return ptr && ((const size_t *)ptr)[-1] == SAMPLE_MAGIC;
+}
+
+static inline struct SampleHeader *sample_header(void *ptr) {
+  return (struct SampleHeader *)((char *)ptr - SAMPLE_HEADER);
+}
+
+static void *plain_alloc(size_t size, size_t alignment) {
+  return alignment ? __libc_memalign(alignment, size) : __libc_malloc(size);
+}
+
+/* uncount a sampled block and return the pointer to hand back to libc */
+static void *release_sample(void *ptr) {
+  struct SampleHeader *header = sample_header(ptr);
+  ((size_t *)ptr)[-1] = 0;
+  if (header->stack) stack_entry_add(header->stack, -header->bytes, 0);
+  return header->base;
+}
+
+static size_t sample_usable_size(void *ptr) {
+  struct SampleHeader *header = sample_header(ptr);
+  return next_usable_size(header->base) -
+         (size_t)((char *)ptr - (char *)header->base);
+}
+
+/* non-zero sampling interval if this allocation is to be sampled */
+static __attribute__((always_inline)) inline size_t sample_due(size_t size) {
+  size_t interval = __atomic_load_n(&sample_interval, __ATOMIC_RELAXED);
+  if (__builtin_expect(!interval || in_profiler, 0)) return 0;
+  bytes_until_sample -= (int64_t)size;
+  if (__builtin_expect(bytes_until_sample > 0, 1)) return 0;
+  return interval;
+}
+
+static __attribute__((noinline)) void *sampled_alloc(size_t size,
+                                                     size_t alignment,
+                                                     size_t interval) {
+  void *pcs[STACK_TABLE_DEPTH];
+  size_t depth, offset;
+  int64_t bytes;
+  char *base;
+  struct SampleHeader *header;
+
+  if (sample_seed == 0) {
+    /* first allocation of this thread: only arm the sampler */
+    bytes_until_sample = next_sample_gap(interval);
+    return plain_alloc(size, alignment);
+  }
+  bytes_until_sample = next_sample_gap(interval);
+  /* memalign rounds such alignments up; leave them to it */
+  if (alignment & (alignment - 1)) return plain_alloc(size, alignment);
+  offset = alignment > SAMPLE_HEADER ? alignment : SAMPLE_HEADER;
+  if (size > SIZE_MAX - offset) return plain_alloc(size, alignment);
+  base = alignment > 16 ? __libc_memalign(offset, size + offset)
+                        : __libc_malloc(size + offset);
+  if (!base) return plain_alloc(size, alignment);
+  in_profiler = 1;
+  /* each sample stands for the bytes it statistically represents */
+  bytes = (int64_t)((double)size / (1.0 - exp(-(double)size / interval)));
+  /* drop sampled_alloc and the allocator entry point */
+  depth = backtrace_capture(NULL, pcs, STACK_TABLE_DEPTH, 2);
+  header = sample_header(base + offset);
+  header->base = base;
+  header->stack = stack_table_add(&heap_stacks, pcs, depth, bytes, 1);
+  header->bytes = bytes;
+  ((size_t *)(base + offset))[-1] = SAMPLE_MAGIC;
+  in_profiler = 0;
+  return base + offset;
+}
+
+/* alignment 0 means malloc's */
+static __attribute__((always_inline)) inline void *allocate(size_t size,
+                                                            size_t alignment) {
+  size_t interval = sample_due(size);
+  if (__builtin_expect(interval != 0, 0))
+    return sampled_alloc(size, alignment, interval);
+  return plain_alloc(size, alignment);
+}
+
+static __attribute__((always_inline)) inline void *reallocate(void *ptr,
+                                                              size_t size) {
+  size_t interval, used;
+  void *result;
+  if (!ptr) return allocate(size, 0);
+  if (__builtin_expect(is_sampled(ptr), 0)) {
+    if (size == 0) {
+      __libc_free(release_sample(ptr));
+      return NULL;
+    }
+    /* the old block stays intact if this fails, as realloc requires */
+    result = allocate(size, 0);
+    if (!result) return NULL;
+    used = sample_usable_size(ptr);
+    memcpy(result, ptr, used < size ? used : size);
+    __libc_free(release_sample(ptr));
+    return result;
+  }
+  result = __libc_realloc(ptr, size);
+  if (!result || !size || !(interval = sample_due(size))) return result;
+  /* move the block into a sampled one; keep the original on failure */
+  ptr = sampled_alloc(size, 0, interval);
+  if (!is_sampled(ptr)) {
+    if (ptr) __libc_free(ptr);
+    return result;
+  }
+  memcpy(ptr, result, size);
+  __libc_free(result);
+  return ptr;
+}
+
+void *malloc(size_t size) { return allocate(size, 0); }
+
+void free(void *ptr) {
+  if (__builtin_expect(is_sampled(ptr), 0)) ptr = release_sample(ptr);
+  __libc_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t total, interval;
+  void *ptr;
+  if (__builtin_mul_overflow(nmemb, size, &total) ||
+      !(interval = sample_due(total)))
+    return __libc_calloc(nmemb, size);
+  ptr = sampled_alloc(total, 0, interval);
+  if (ptr) memset(ptr, 0, total);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) { return reallocate(ptr, size); }
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return reallocate(ptr, total);
+}
+
+size_t malloc_usable_size(void *ptr) {
+  if (!next_usable_size) resolve_usable_size();
+  if (is_sampled(ptr)) return sample_usable_size(ptr);
+  return next_usable_size(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return allocate(size, alignment);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return allocate(size, alignment);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  ptr = allocate(size, alignment);
+  if (!ptr) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+int backtrace_heap_profiler_start(size_t interval) {
+  if (!next_usable_size) resolve_usable_size();
+  if (!next_usable_size) return -ENOSYS;
+  if (interval == 0) interval = HEAP_DEFAULT_INTERVAL;
+  __atomic_store_n(&sample_interval, interval, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void backtrace_heap_profiler_stop() {
+  __atomic_store_n(&sample_interval, 0, __ATOMIC_RELEASE);
+}
+
+int backtrace_heap_profile_dump(int fd, enum backtrace_format format) {
+  int ret, saved = in_profiler;
+  in_profiler = 1;
+  ret = stack_table_dump(&heap_stacks, fd, format, "bytes in use");
+  in_profiler = saved;
+  return ret;
+}
+
+struct DumpSchedule {
+  int fd;
+  enum backtrace_format format;
+  unsigned seconds;
+};
+
+static void *dump_loop(void *arg) {
+  struct DumpSchedule schedule = *(struct DumpSchedule *)arg;
+  in_profiler = 1;
+  __libc_free(arg);
+  for (;;) {
+    sleep(schedule.seconds);
+    backtrace_heap_profile_dump(schedule.fd, schedule.format);
+  }
+  return NULL;
+}
+
+int backtrace_heap_profile_dump_every(int fd, enum backtrace_format format,
+                                      unsigned seconds) {
+  pthread_t thread;
+  struct DumpSchedule *schedule;
+  int ret;
+
+  if (seconds == 0) return -EINVAL;
+  schedule = __libc_malloc(sizeof(*schedule));
+  if (!schedule) return -ENOMEM;
+  schedule->fd = fd;
+  schedule->format = format;
+  schedule->seconds = seconds;
+  ret = pthread_create(&thread, NULL, dump_loop, schedule);
+  if (ret != 0) {
+    __libc_free(schedule);
+    return -ret;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+#else
+
+/* built without BACKTRACE_HEAP_PROFILER: nothing is interposed or sampled */
+
+int backtrace_heap_profiler_start(size_t interval) { return -ENOSYS; }
+
+void backtrace_heap_profiler_stop() {}
+
+int backtrace_heap_profile_dump(int fd, enum backtrace_format format) {
+  return -ENOSYS;
+}
+
+int backtrace_heap_profile_dump_every(int fd, enum backtrace_format format,
+                                      unsigned seconds) {
+  return -ENOSYS;
+}
+
+#endif
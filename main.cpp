@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <exception>
 
+#include "Stack.h"
 #include "backtrace.h"
 
 int func2(int a, int b);
@@ -43,7 +45,81 @@ void exceptionFunction() { throw std::exception(); }
 
 void exceptionFunction1() { exceptionFunction(); }
 
+#ifdef BACKTRACE_EXCEPTION_STACK
+void print_frame(const void *pc, const char *name, size_t offset,
+                 void *userdata) {
+  if (name)
+    printf("\t=>%s()+0x%zx\n", name, offset);
+  else
+    printf("\t=>%p\n", pc);
+}
+#endif
+
+// Both captures start at the same call site, so only the first frame differs.
+__attribute__((noinline)) bool captures_agree() {
+  void *full[64], *incremental[64];
+  size_t full_depth = backtrace_capture(NULL, full, 64, 0);
+  size_t incremental_depth =
+      backtrace_capture_incremental(NULL, incremental, 64, 0);
+  return full_depth == incremental_depth &&
+         std::equal(full + 1, full + full_depth, incremental + 1);
+}
+
+__attribute__((noinline)) bool shared_callee() {
+  bool agree = captures_agree();
+  asm volatile("");
+  return agree;
+}
+
+// Siblings with equal frames leave shared_callee() and captures_agree() at
+// the same CFAs and pcs, so only the return address into them differs.
+__attribute__((noinline)) bool sibling_a() {
+  bool agree = shared_callee();
+  asm volatile("");
+  return agree;
+}
+
+__attribute__((noinline)) bool sibling_b() {
+  bool agree = shared_callee();
+  asm volatile("");
+  return agree;
+}
+
+bool check_incremental_capture() {
+  bool agree = true;
+  for (int i = 0; i < 4; i++) agree &= i & 1 ? sibling_b() : sibling_a();
+  return agree;
+}
+
+// A captured stack runs from the executable into libc; the extra pc
+// belongs to no module and must come back raw.
+bool check_encode_round_trip() {
+  void *pcs[32];
+  size_t depth = backtrace_capture(NULL, pcs, 31, 0);
+  pcs[depth++] = reinterpret_cast<void *>(0x10);
+  unsigned char encoded[512];
+  size_t size = backtrace_encode(pcs, depth, encoded, sizeof(encoded));
+  backtrace_frame_ref frames[32];
+  if (size == 0 || backtrace_decode(encoded, size, frames, 32) != depth)
+    return false;
+  size_t modules = 0;
+  uint32_t last = BACKTRACE_NO_MODULE;
+  for (size_t i = 0; i < depth; i++) {
+    size_t index;
+    uintptr_t offset;
+    if (backtrace_module_of(pcs[i], &index, &offset) != 0) {
+      index = BACKTRACE_NO_MODULE;
+      offset = reinterpret_cast<uintptr_t>(pcs[i]);
+    }
+    if (frames[i].module != index || frames[i].offset != offset) return false;
+    if (frames[i].module != last) modules++;
+    last = frames[i].module;
+  }
+  return modules >= 3 && last == BACKTRACE_NO_MODULE;
+}
+
 int main() noexcept {
+  backtrace_init(BACKTRACE_INIT_SYNC);
   struct sigaction sega;
   sega.sa_sigaction = handler;
   sega.sa_flags = SA_SIGINFO;
@@ -57,6 +133,28 @@ int main() noexcept {
 
   printf("funcptr's name = %s\n",
          addr_to_name(reinterpret_cast<const void *>(funcptr)));
+  backtrace::Stack<4> stack;
+  stack.Capture();
+  printf("stack hash = %zx\n", stack.hash());
+  for (const auto &frame : stack) {
+    if (frame.name())
+      printf("\t%s\n", frame.name());
+    else
+      printf("\t%p\n", frame.pc);
+  }
+  show_backtrace_all_threads();
+  printf("encode round trip: %s\n",
+         check_encode_round_trip() ? "ok" : "MISMATCH");
+  printf("incremental capture: %s\n",
+         check_incremental_capture() ? "ok" : "MISMATCH");
+#ifdef BACKTRACE_EXCEPTION_STACK
+  try {
+    exceptionFunction1();
+  } catch (const std::exception &) {
+    printf("exception thrown from:\n");
+    backtrace_current_exception_stack(print_frame, NULL);
+  }
+#endif
   if (0)
     abortFunction1();
   else
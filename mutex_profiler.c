@@ -0,0 +1,139 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "backtrace.h"
+#include "stack_table.h"
+
+#ifdef BACKTRACE_MUTEX_PROFILER
+
+/*
+ * Lock contention profiler. The lock functions below replace the libc ones
+ * when this file is linked into the executable. An acquisition is only
+ * timed after a trylock has failed, so uncontended locks cost the same as
+ * before.
+ */
+
+#define MUTEX_STACKS 4096
+
+#define MUTEX_TLS __thread __attribute__((tls_model("initial-exec")))
+
+typedef int (*LockFunction)(void *lock);
+
+static LockFunction next_mutex_lock;
+static LockFunction next_rwlock_rdlock;
+static LockFunction next_rwlock_wrlock;
+
+/* -1 while the profiler is stopped */
+static int64_t wait_threshold = -1;
+static struct StackTable mutex_stacks = STACK_TABLE_INITIALIZER(MUTEX_STACKS);
+/* set while the profiler itself runs, so its own locking is ignored */
+static MUTEX_TLS int in_profiler;
+
+static LockFunction resolve(LockFunction *cache, const char *name) {
+  LockFunction function = __atomic_load_n(cache, __ATOMIC_ACQUIRE);
+  if (!function) {
+    function = (LockFunction)dlsym(RTLD_NEXT, name);
+    __atomic_store_n(cache, function, __ATOMIC_RELEASE);
+  }
+  return function;
+}
+
+static __attribute__((constructor)) void resolve_all() {
+  resolve(&next_mutex_lock, "pthread_mutex_lock");
+  resolve(&next_rwlock_rdlock, "pthread_rwlock_rdlock");
+  resolve(&next_rwlock_wrlock, "pthread_rwlock_wrlock");
+}
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static __attribute__((noinline)) void record_wait(int64_t waited) {
+  void *pcs[STACK_TABLE_DEPTH];
+  size_t depth;
+  in_profiler = 1;
+  /* drop record_wait and the lock entry point */
+  depth = backtrace_capture(NULL, pcs, STACK_TABLE_DEPTH, 2);
+  stack_table_add(&mutex_stacks, pcs, depth, waited, 1);
+  in_profiler = 0;
+}
+
+/* called only once the trylock has failed */
+static __attribute__((always_inline)) inline int timed_lock(
+    LockFunction lock, void *object, int64_t threshold) {
+  int64_t start = now_ns(), waited;
+  int ret = lock(object);
+  waited = now_ns() - start;
+  if (waited >= threshold) record_wait(waited);
+  return ret;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+  LockFunction lock = resolve(&next_mutex_lock, "pthread_mutex_lock");
+  int64_t threshold = __atomic_load_n(&wait_threshold, __ATOMIC_RELAXED);
+  int ret;
+  if (__builtin_expect(threshold < 0, 1)) return lock(mutex);
+  ret = pthread_mutex_trylock(mutex);
+  if (ret != EBUSY) return ret;
+  if (in_profiler) return lock(mutex);
+  return timed_lock(lock, mutex, threshold);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+  LockFunction lock = resolve(&next_rwlock_rdlock, "pthread_rwlock_rdlock");
+  int64_t threshold = __atomic_load_n(&wait_threshold, __ATOMIC_RELAXED);
+  int ret;
+  if (__builtin_expect(threshold < 0, 1)) return lock(rwlock);
+  ret = pthread_rwlock_tryrdlock(rwlock);
+  if (ret != EBUSY) return ret;
+  if (in_profiler) return lock(rwlock);
+  return timed_lock(lock, rwlock, threshold);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+  LockFunction lock = resolve(&next_rwlock_wrlock, "pthread_rwlock_wrlock");
+  int64_t threshold = __atomic_load_n(&wait_threshold, __ATOMIC_RELAXED);
+  int ret;
+  if (__builtin_expect(threshold < 0, 1)) return lock(rwlock);
+  ret = pthread_rwlock_trywrlock(rwlock);
+  if (ret != EBUSY) return ret;
+  if (in_profiler) return lock(rwlock);
+  return timed_lock(lock, rwlock, threshold);
+}
+
+int backtrace_mutex_profiler_start(uint64_t threshold_ns) {
+  resolve_all();
+  __atomic_store_n(&wait_threshold, (int64_t)threshold_ns, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void backtrace_mutex_profiler_stop() {
+  __atomic_store_n(&wait_threshold, -1, __ATOMIC_RELEASE);
+}
+
+int backtrace_mutex_profile_dump(int fd, enum backtrace_format format) {
+  int ret, saved = in_profiler;
+  in_profiler = 1;
+  ret = stack_table_dump(&mutex_stacks, fd, format, "ns waited");
+  in_profiler = saved;
+  return ret;
+}
+
+#else
+
+/* built without BACKTRACE_MUTEX_PROFILER: no lock is interposed */
+
+int backtrace_mutex_profiler_start(uint64_t threshold_ns) { return -ENOSYS; }
+
+void backtrace_mutex_profiler_stop() {}
+
+int backtrace_mutex_profile_dump(int fd, enum backtrace_format format) {
+  return -ENOSYS;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __BACKTRACE_SIGNAL_CONTEXT_H
+#define __BACKTRACE_SIGNAL_CONTEXT_H
+
+/*
+ * Entry points handed a ucontext are running inside a signal handler. They
+ * bracket their lookups with these, so that symbolization there never opens
+ * or reads debug files.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void backtrace_signal_enter(void);
+void backtrace_signal_leave(void);
+/* non-zero inside such a bracket or while on the alternate signal stack */
+int backtrace_in_signal(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __BACKTRACE_STACK_HASH_H
+#define __BACKTRACE_STACK_HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The one hash of a captured stack, shared by the C stack table and dedup
+ * code and the C++ backtrace::Stack.
+ */
+
+static inline uint64_t stack_hash(void *const *pcs, size_t depth) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ depth;
+  size_t i;
+  for (i = 0; i < depth; i++) {
+    hash ^= (uintptr_t)pcs[i];
+    hash *= 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "stack_table.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void table_lock(struct StackTable *table) {
+  while (__atomic_test_and_set(&table->lock, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static void table_unlock(struct StackTable *table) {
+  __atomic_clear(&table->lock, __ATOMIC_RELEASE);
+}
+
+/* called with the lock held */
+static int table_reserve(struct StackTable *table) {
+  void *index, *entries;
+  if (table->entries) return 1;
+  index = mmap(NULL, 2 * table->capacity * sizeof(*table->index),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (index == MAP_FAILED) return 0;
+  entries = mmap(NULL, table->capacity * sizeof(*table->entries),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (entries == MAP_FAILED) {
+    munmap(index, 2 * table->capacity * sizeof(*table->index));
+    return 0;
+  }
+  table->index = index;
+  __atomic_store_n(&table->entries, entries, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void stack_entry_add(struct StackEntry *entry, int64_t value, uint64_t count) {
+  __atomic_add_fetch(&entry->value, value, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&entry->count, count, __ATOMIC_RELAXED);
+}
+
+struct StackEntry *stack_table_add(struct StackTable *table, void *const *pcs,
+                                   size_t depth, int64_t value,
+                                   uint64_t count) {
+  struct StackEntry *entry = NULL;
+  uint64_t hash;
+  size_t mask, slot;
+
+  if (depth > STACK_TABLE_DEPTH) depth = STACK_TABLE_DEPTH;
+  hash = stack_hash(pcs, depth);
+  table_lock(table);
+  if (!table_reserve(table)) goto out;
+  /* the index has twice as many slots as there are entries */
+  mask = 2 * table->capacity - 1;
+  for (slot = hash & mask; table->index[slot]; slot = (slot + 1) & mask) {
+    struct StackEntry *candidate = &table->entries[table->index[slot] - 1];
+    if (candidate->hash == hash && candidate->depth == depth &&
+        memcmp(candidate->pcs, pcs, depth * sizeof(*pcs)) == 0) {
+      entry = candidate;
+      goto out;
+    }
+  }
+  if (table->used == table->capacity) goto out;
+  entry = &table->entries[table->used];
+  entry->hash = hash;
+  entry->depth = depth;
+  memcpy(entry->pcs, pcs, depth * sizeof(*pcs));
+  table->index[slot] = (uint32_t)++table->used;
+out:
+  if (!entry) table->dropped += count;
+  table_unlock(table);
+  if (entry) stack_entry_add(entry, value, count);
+  return entry;
+}
+
+int stack_table_dump(struct StackTable *table, int fd,
+                     enum backtrace_format format, const char *unit) {
+  struct StackEntry *entries =
+      __atomic_load_n(&table->entries, __ATOMIC_ACQUIRE);
+  size_t used, i;
+  int ret = 0;
+
+  if (!entries) return 0;
+  /* entries are append-only, so the published prefix can be read unlocked */
+  table_lock(table);
+  used = table->used;
+  table_unlock(table);
+  for (i = 0; i < used && ret == 0; i++) {
+    struct StackEntry *entry = &entries[i];
+    int64_t value = __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+    if (value <= 0) continue;
+    if (format == BACKTRACE_FORMAT_TEXT) {
+      char header[96];
+      int n = snprintf(header, sizeof(header), "%lld %s in %llu samples\n",
+                       (long long)value, unit,
+                       (unsigned long long)__atomic_load_n(
+                           &entry->count, __ATOMIC_RELAXED));
+      if (write(fd, header, n) != n) return -errno;
+    }
+    ret = backtrace_write_pcs(fd, format, (const void *const *)entry->pcs,
+                              entry->depth, (unsigned long)value);
+  }
+  return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef __BACKTRACE_STACK_TABLE_H
+#define __BACKTRACE_STACK_TABLE_H
+#include <stdint.h>
+
+#include "backtrace.h"
+#include "stack_hash.h"
+
+/*
+ * Append-only table aggregating a value per distinct stack, used by the
+ * profilers. Storage comes from mmap and locking is a private spinlock, so
+ * it can be updated from inside malloc and pthread_mutex_lock interposers.
+ */
+
+#define STACK_TABLE_DEPTH 32
+
+struct StackEntry {
+  uint64_t hash;
+  size_t depth;
+  void *pcs[STACK_TABLE_DEPTH];
+  int64_t value; /* updated with __atomic builtins */
+  uint64_t count;
+};
+
+struct StackTable {
+  size_t capacity; /* power of two */
+  size_t used;
+  uint64_t dropped; /* samples lost because the table was full */
+  int lock;
+  uint32_t *index; /* open addressing, entry number + 1, 0 if empty */
+  struct StackEntry *entries;
+};
+
+#define STACK_TABLE_INITIALIZER(capacity) \
+  { (capacity), 0, 0, 0, NULL, NULL }
+
+/* find or insert the entry for pcs and add value and count to it */
+struct StackEntry *stack_table_add(struct StackTable *table, void *const *pcs,
+                                   size_t depth, int64_t value,
+                                   uint64_t count);
+void stack_entry_add(struct StackEntry *entry, int64_t value, uint64_t count);
+/**
+ * write every entry whose value is positive, weighted by that value
+ * @param unit printed after the value in BACKTRACE_FORMAT_TEXT
+ * @return 0 on success, -errno on failure
+ */
+int stack_table_dump(struct StackTable *table, int fd,
+                     enum backtrace_format format, const char *unit);
+
+#endif
@@ -0,0 +1,312 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backtrace.h"
+
+#define THREAD_MAX_DEPTH 64
+
+enum slot_state { SLOT_PENDING, SLOT_CAPTURING, SLOT_DONE, SLOT_ABANDONED };
+
+struct ThreadSlot {
+  pid_t tid;
+  int state;
+  size_t depth;
+  void *pcs[THREAD_MAX_DEPTH];
+};
+
+struct Snapshot {
+  struct ThreadSlot *slots; /* sorted by tid */
+  size_t count;
+  sem_t done;
+  struct Snapshot *next; /* in retired_snapshots */
+};
+
+/* snapshot currently being collected, read by the signal handler */
+static struct Snapshot *current_snapshot;
+/* handlers that may still be touching current_snapshot */
+static int active_handlers;
+/* collected snapshots a late handler may still touch, under snapshot_lock */
+static struct Snapshot *retired_snapshots;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+static pid_t current_tid() { return (pid_t)syscall(SYS_gettid); }
+
+static struct ThreadSlot *find_slot(struct Snapshot *snapshot, pid_t tid) {
+  size_t lo = 0, hi = snapshot->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (snapshot->slots[mid].tid == tid) return &snapshot->slots[mid];
+    if (snapshot->slots[mid].tid < tid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+static void snapshot_handler(int no, siginfo_t *info, void *ctx) {
+  int saved_errno = errno;
+  struct Snapshot *snapshot;
+  struct ThreadSlot *slot;
+  int expected = SLOT_PENDING;
+
+  __atomic_add_fetch(&active_handlers, 1, __ATOMIC_SEQ_CST);
+  snapshot = __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+  if (snapshot) {
+    slot = find_slot(snapshot, current_tid());
+    if (slot && __atomic_compare_exchange_n(&slot->state, &expected,
+                                            SLOT_CAPTURING, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+      slot->depth = backtrace_capture((const ucontext_t *)ctx, slot->pcs,
+                                      THREAD_MAX_DEPTH, 0);
+      /* fails if the caller gave up on us meanwhile */
+      expected = SLOT_CAPTURING;
+      __atomic_compare_exchange_n(&slot->state, &expected, SLOT_DONE, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      sem_post(&snapshot->done);
+    }
+  }
+  __atomic_sub_fetch(&active_handlers, 1, __ATOMIC_SEQ_CST);
+  errno = saved_errno;
+}
+
+static void install_handler() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = snapshot_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(BACKTRACE_ALL_THREADS_SIGNAL, &action, NULL);
+}
+
+static int compare_slot(const void *a, const void *b) {
+  pid_t lhs = ((const struct ThreadSlot *)a)->tid;
+  pid_t rhs = ((const struct ThreadSlot *)b)->tid;
+  return lhs < rhs ? -1 : lhs > rhs;
+}
+
+/* list /proc/self/task into a freshly allocated, tid-sorted slot array */
+static struct ThreadSlot *list_threads(size_t *count) {
+  DIR *dir = opendir("/proc/self/task");
+  struct dirent *entry;
+  struct ThreadSlot *slots = NULL;
+  size_t capacity = 0;
+
+  *count = 0;
+  if (!dir) return NULL;
+  while ((entry = readdir(dir)) != NULL) {
+    pid_t tid = (pid_t)atoi(entry->d_name);
+    if (tid <= 0) continue;
+    if (*count == capacity) {
+      struct ThreadSlot *grown;
+      capacity = capacity ? capacity * 2 : 64;
+      grown = realloc(slots, capacity * sizeof(*slots));
+      if (!grown) {
+        free(slots);
+        closedir(dir);
+        return NULL;
+      }
+      slots = grown;
+    }
+    memset(&slots[*count], 0, sizeof(*slots));
+    slots[(*count)++].tid = tid;
+  }
+  closedir(dir);
+  qsort(slots, *count, sizeof(*slots), compare_slot);
+  return slots;
+}
+
+/* CLOCK_REALTIME, as sem_timedwait wants */
+static void deadline_after(int timeout_ms, struct timespec *deadline) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+static bool deadline_passed(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec > deadline->tv_sec ||
+         (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void wait_handlers(struct Snapshot *snapshot, size_t pending,
+                          const struct timespec *deadline) {
+  /* answers already posted are taken without blocking, but not past it */
+  while (pending > 0 && !deadline_passed(deadline)) {
+    if (sem_timedwait(&snapshot->done, deadline) == 0)
+      pending--;
+    else if (errno != EINTR)
+      break;
+  }
+}
+
+/* stop handlers from touching the snapshot; unfinished slots are abandoned */
+static void retire_snapshot(struct Snapshot *snapshot) {
+  size_t i;
+  __atomic_store_n(&current_snapshot, NULL, __ATOMIC_SEQ_CST);
+  for (i = 0; i < snapshot->count; i++) {
+    int *state = &snapshot->slots[i].state;
+    int expected = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+    while ((expected == SLOT_PENDING || expected == SLOT_CAPTURING) &&
+           !__atomic_compare_exchange_n(state, &expected, SLOT_ABANDONED,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+      ;
+  }
+}
+
+static void free_snapshot(struct Snapshot *snapshot) {
+  sem_destroy(&snapshot->done);
+  free(snapshot->slots);
+  free(snapshot);
+}
+
+/*
+ * Called under snapshot_lock with no snapshot published: a handler that is
+ * not counted in active_handlers can only ever see a later snapshot.
+ */
+static void free_retired_snapshots() {
+  if (__atomic_load_n(&active_handlers, __ATOMIC_SEQ_CST) != 0) return;
+  while (retired_snapshots) {
+    struct Snapshot *next = retired_snapshots->next;
+    free_snapshot(retired_snapshots);
+    retired_snapshots = next;
+  }
+}
+
+int backtrace_all_threads(int timeout_ms,
+                          void (*callback)(pid_t tid, const void *pc,
+                                           const char *name, size_t offset,
+                                           void *userdata),
+                          void *userdata) {
+  struct Snapshot *snapshot;
+  pid_t self = current_tid();
+  pid_t pid = getpid();
+  size_t i, j, pending = 0;
+  int answered = 0;
+  struct timespec deadline;
+
+  /* from entry, so that signalling many threads counts against it too */
+  deadline_after(timeout_ms, &deadline);
+  pthread_once(&handler_once, install_handler);
+  snapshot = calloc(1, sizeof(*snapshot));
+  if (!snapshot) return -1;
+  snapshot->slots = list_threads(&snapshot->count);
+  if (!snapshot->slots || sem_init(&snapshot->done, 0, 0) == -1) {
+    free(snapshot->slots);
+    free(snapshot);
+    return -1;
+  }
+
+  pthread_mutex_lock(&snapshot_lock);
+  __atomic_store_n(&current_snapshot, snapshot, __ATOMIC_SEQ_CST);
+  /* signal every thread before waiting so they capture in parallel */
+  for (i = 0; i < snapshot->count; i++) {
+    struct ThreadSlot *slot = &snapshot->slots[i];
+    if (slot->tid == self) continue;
+    /* the rest stay pending and are reported as not answering */
+    if (deadline_passed(&deadline)) break;
+    if (syscall(SYS_tgkill, pid, slot->tid, BACKTRACE_ALL_THREADS_SIGNAL) == 0)
+      pending++;
+    else
+      slot->state = SLOT_ABANDONED; /* exited meanwhile */
+  }
+  {
+    struct ThreadSlot *slot = find_slot(snapshot, self);
+    if (slot) {
+      slot->depth = backtrace_capture(NULL, slot->pcs, THREAD_MAX_DEPTH, 1);
+      slot->state = SLOT_DONE;
+    }
+  }
+  wait_handlers(snapshot, pending, &deadline);
+  retire_snapshot(snapshot);
+  pthread_mutex_unlock(&snapshot_lock);
+
+  for (i = 0; i < snapshot->count; i++) {
+    struct ThreadSlot *slot = &snapshot->slots[i];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_DONE) {
+      if (callback)
+        callback(slot->tid, NULL, NULL, BACKTRACE_THREAD_NO_RESPONSE,
+                 userdata);
+      continue;
+    }
+    answered++;
+    if (slot->depth == 0 && callback)
+      callback(slot->tid, NULL, NULL, BACKTRACE_THREAD_NO_FRAMES, userdata);
+    for (j = 0; callback && j < slot->depth; j++)
+      callback(slot->tid, slot->pcs[j], addr_to_name(slot->pcs[j]),
+               addr_to_offset(slot->pcs[j]), userdata);
+  }
+  /* a late handler may still be writing to an abandoned slot */
+  pthread_mutex_lock(&snapshot_lock);
+  snapshot->next = retired_snapshots;
+  retired_snapshots = snapshot;
+  free_retired_snapshots();
+  pthread_mutex_unlock(&snapshot_lock);
+  return answered;
+}
+
+/* frames of one thread, written out once the next thread starts */
+struct ThreadPrinter {
+  pid_t tid; /* 0 before the first thread */
+  int answered;
+  size_t status; /* backtrace_thread_status if nothing was captured */
+  size_t depth;
+  void *pcs[THREAD_MAX_DEPTH];
+};
+
+static void print_thread(const struct ThreadPrinter *printer) {
+  char header[48];
+  int n;
+  if (printer->tid == 0) return;
+  if (printer->answered)
+    n = snprintf(header, sizeof(header), "Thread %d:\n", (int)printer->tid);
+  else
+    n = snprintf(header, sizeof(header),
+                 printer->status == BACKTRACE_THREAD_NO_FRAMES
+                     ? "Thread %d: no frames\n\n"
+                     : "Thread %d: no response\n\n",
+                 (int)printer->tid);
+  if (write(STDOUT_FILENO, header, n) != n || !printer->answered) return;
+  backtrace_write_pcs(STDOUT_FILENO, BACKTRACE_FORMAT_TEXT,
+                      (const void *const *)printer->pcs, printer->depth, 1);
+}
+
+static void thread_collect(pid_t tid, const void *pc, const char *name,
+                           size_t offset, void *userdata) {
+  struct ThreadPrinter *printer = userdata;
+  if (printer->tid != tid) {
+    print_thread(printer);
+    printer->tid = tid;
+    printer->answered = pc != NULL;
+    printer->status = offset;
+    printer->depth = 0;
+  }
+  if (pc && printer->depth < THREAD_MAX_DEPTH)
+    printer->pcs[printer->depth++] = (void *)pc;
+}
+
+void show_backtrace_all_threads() {
+  struct ThreadPrinter printer;
+  printer.tid = 0;
+  fflush(stdout);
+  backtrace_all_threads(1000, thread_collect, &printer);
+  print_thread(&printer);
+}